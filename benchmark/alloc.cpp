@@ -0,0 +1,78 @@
+/* Allocation throughput microbenchmark.
+ *
+ * Every thread allocates small objects from one shared orbit allocator.
+ * Compares the spinlock path, the lock-free bump path, and per-thread
+ * caches from 1 to 64 threads.  This does not need an orbit, so it can run
+ * on a stock kernel. */
+
+#include "orbit.h"
+#include <sys/mman.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+
+int N = 1 << 22;	/* Total allocations per run */
+const size_t OBJ_SIZE = 16;
+
+enum alloc_mode { MODE_SPINLOCK, MODE_LOCKFREE, MODE_TCACHE, };
+const char *mode_names[] = { "spinlock", "lockfree", "tcache", };
+
+void worker(struct orbit_allocator *alloc, int n) {
+	for (int i = 0; i < n; ++i) {
+		void *p = orbit_alloc(alloc, OBJ_SIZE);
+		__asm__ __volatile__ ("" : : "r"(p) : "memory");
+	}
+}
+
+void bench_alloc(enum alloc_mode mode, int nthd) {
+	struct orbit_pool *pool;
+	struct orbit_allocator *alloc;
+	std::vector<std::thread> thds;
+
+	/* Leave room for the chunks wasted by per-thread caches. */
+	pool = orbit_pool_create(NULL, (size_t)N * OBJ_SIZE + nthd * 65536);
+	assert(pool != NULL);
+	alloc = orbit_allocator_from_pool(pool, false);
+	assert(alloc != NULL);
+
+	if (mode == MODE_SPINLOCK)
+		alloc->lockfree = false;
+	else if (mode == MODE_TCACHE)
+		orbit_allocator_set_tcache(alloc, 65536);
+
+	auto t1 = high_resolution_clock::now();
+	for (int i = 0; i < nthd; ++i)
+		thds.emplace_back(worker, alloc, N / nthd);
+	for (auto &thd : thds)
+		thd.join();
+	auto t2 = high_resolution_clock::now();
+
+	long long duration = duration_cast<nanoseconds>(t2 - t1).count();
+	printf("%s %d threads alloc %d times takes %lld ns, %.2f ops\n",
+		mode_names[mode], nthd, N, duration,
+		(double)N / duration * 1000000000LL);
+
+	orbit_allocator_destroy(alloc);
+	munmap(pool->rawptr, pool->length);
+	free(pool);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 1 && sscanf(argv[1], "%d", &N) != 1) {
+		fprintf(stderr, "Usage: %s [N]\n", argv[0]);
+		return 1;
+	}
+
+	printf("Benchmark with N = %d, object size = %lu\n", N, OBJ_SIZE);
+
+	for (int mode = MODE_SPINLOCK; mode <= MODE_TCACHE; ++mode)
+		for (int nthd = 1; nthd <= 64; nthd *= 2)
+			bench_alloc((enum alloc_mode)mode, nthd);
+	return 0;
+}
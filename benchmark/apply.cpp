@@ -0,0 +1,86 @@
+/* Scratch apply throughput microbenchmark.
+ *
+ * Fills a scratch with updates of one size into a destination buffer, then
+ * measures how fast orbit_apply copies them into place, from 8 byte
+ * updates to 8 MB ones, on one thread and with orbit_apply_parallel.
+ * The scratch is built in this process, so this does not need an orbit,
+ * and can run on a stock kernel. */
+
+#include "orbit.h"
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+
+using namespace std::chrono;
+
+size_t TOTAL = 64 << 20;	/* Bytes of update data per run */
+const int REPEAT = 5;
+
+void bench_apply(char *dst, size_t size, int nthd) {
+	size_t n = TOTAL / size;
+	size_t scratch_size = n * (sizeof(struct orbit_repr) + size + 16);
+	struct orbit_scratch s;
+	size_t count;
+	long long best = 0;
+
+	memset(&s, 0, sizeof(s));
+	s.ptr = aligned_alloc(4096, (scratch_size + 4095) & ~4095UL);
+	assert(s.ptr != NULL);
+	s.size_limit = scratch_size;
+
+	for (size_t i = 0; i < n; ++i) {
+		int ret = orbit_scratch_push_update(&s, dst + i * size, size);
+		assert(ret > 0);
+		(void)ret;
+	}
+	count = s.count;
+
+	for (int r = 0; r < REPEAT; ++r) {
+		s.cursor = 0;
+		s.count = count;
+
+		auto t1 = high_resolution_clock::now();
+		if (nthd == 1)
+			orbit_apply(&s, false);
+		else
+			orbit_apply_parallel(&s, nthd);
+		auto t2 = high_resolution_clock::now();
+
+		long long duration = duration_cast<nanoseconds>(t2 - t1).count();
+		if (best == 0 || duration < best)
+			best = duration;
+	}
+
+	printf("size %8lu, %2d threads, %8lu updates takes %10lld ns, "
+		"%.2f GB/s\n", size, nthd, n, best, (double)TOTAL / best);
+
+	free(s.ptr);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned int nthd = std::thread::hardware_concurrency();
+	char *dst;
+
+	if (argc > 1 && sscanf(argv[1], "%lu", &TOTAL) != 1) {
+		fprintf(stderr, "Usage: %s [total bytes]\n", argv[0]);
+		return 1;
+	}
+
+	printf("Benchmark with %lu bytes of updates per run\n", TOTAL);
+
+	dst = (char*)aligned_alloc(4096, TOTAL);
+	assert(dst != NULL);
+	memset(dst, 1, TOTAL);
+
+	for (size_t size = 8; size <= (16 << 20) && size <= TOTAL; size *= 4) {
+		bench_apply(dst, size, 1);
+		if (nthd > 1)
+			bench_apply(dst, size, nthd);
+	}
+
+	free(dst);
+	return 0;
+}
@@ -3,12 +3,32 @@
 
 #ifdef __cplusplus
 #include <cstddef>
+#include <stdint.h>
+#include <cstdio>
 #include <cstring>
+#include <functional>
+#include <list>
+#include <map>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <type_traits>
+#include <unordered_map>
+#endif
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define ORBIT_HAVE_MEMORY_RESOURCE 1
+#endif
+#endif
 extern "C" {
 #else
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #endif
 
@@ -92,6 +112,7 @@ struct orbit_module {
 
 	orbit_entry entry_func;
 	char name[ORBIT_NAME_LEN];
+	struct orbit_scratch_ctx *scratch_ctx; // set by orbit_scratch_ctx_create
 };
 
 /*
@@ -126,6 +147,7 @@ struct orbit_pool {
 	size_t length;	// the pool should be page-aligned
 	size_t used;
 	enum orbit_pool_mode mode;
+	struct orbit_allocator *alloc;	// set by orbit_allocator_from_pool
 };
 
 // typedef int(*orbit_callback)(struct orbit_update*);
@@ -171,8 +193,74 @@ struct orbit_any {
 	char data[];
 };
 
+/*
+ * Update of a range stored as the runs of bytes that differ from what the
+ * main program has.
+ *
+ * Data is a sequence of runs, each a struct orbit_delta_run followed by
+ * `length` bytes, starting at 4-byte aligned offsets.
+ */
+struct orbit_delta {
+	void *ptr;
+	unsigned int length;	/* Size of the whole range */
+	unsigned int size;	/* Size of the encoded runs in data */
+	char data[];
+};
+
+struct orbit_delta_run {
+	unsigned int offset;
+	unsigned int length;
+};
+
+/*
+ * Small updates packed with compact headers, see ORBIT_SCRATCH_PACKED.
+ *
+ * Each update in data is a tag byte, with the record type in the high four
+ * bits and the length in the low four (15 means a varint length follows),
+ * then the zigzag varint distance of its address from the end of the
+ * previous update, then its data.
+ */
+struct orbit_packed {
+	unsigned int size;	/* Size of the encoded updates in data */
+	unsigned int count;	/* Number of updates */
+	char data[];
+};
+
+/* Largest update put in an orbit_packed record */
+#define ORBIT_PACKED_MAX 64
+
+/*
+ * Store of a 1, 2, 4 or 8 byte value, by the ORBIT_STORE* type of the
+ * record.  The value is kept in the record, and `ptr` must be aligned to
+ * its size.
+ */
+struct orbit_store {
+	void *ptr;
+	uint64_t value;
+};
+
+/*
+ * Operation applied to a batch of `count` argument tuples at once.  Argv
+ * holds the tuples one after another, `argc` arguments each.
+ */
+typedef unsigned long(*orbit_batch_func)(size_t count, size_t argc,
+		unsigned long argv[]);
+
+/*
+ * The same operation pushed for many argument tuples, called once by
+ * orbit_apply() with all of them, see orbit_scratch_push_batch().
+ */
+struct orbit_batch {
+	orbit_batch_func func;
+	unsigned int argc;	/* Arguments per tuple */
+	unsigned int count;	/* Number of tuples */
+	unsigned long argv[];
+};
+
 enum orbit_type { ORBIT_END, ORBIT_UNKNOWN, ORBIT_ANY,
-		  ORBIT_UPDATE, ORBIT_OPERATION, };
+		  ORBIT_UPDATE, ORBIT_OPERATION, ORBIT_DELTA, ORBIT_PACKED,
+		  ORBIT_STORE8, ORBIT_STORE16, ORBIT_STORE32, ORBIT_STORE64,
+		  ORBIT_BATCH, };
 
 struct orbit_repr {
 	enum orbit_type type;
@@ -181,6 +269,10 @@ struct orbit_repr {
 		struct orbit_update update;
 		struct orbit_operation operation;
 		struct orbit_any any;
+		struct orbit_delta delta;
+		struct orbit_packed packed;
+		struct orbit_store store;
+		struct orbit_batch batch;
 	};
 };
 
@@ -252,6 +344,22 @@ struct orbit_pool *orbit_pool_create(struct orbit_module *ob,
 struct orbit_pool *orbit_pool_create_at(struct orbit_module *ob,
 					size_t init_pool_size, void *addr);
 
+struct orbit_range {
+	void *start;
+	void *end;
+};
+
+/*
+ * Get the address ranges of a pool that are sent on orbit_call, i.e. the
+ * used part of the pool without the holes left by freed large blocks.
+ *
+ * Returns the number of ranges, which is at least 1.  If it is larger than
+ * `max`, the last stored range extends to cover the rest.  With `max` 0
+ * only the number is returned.
+ */
+size_t orbit_pool_ranges(struct orbit_pool *pool, struct orbit_range *ranges,
+		size_t max);
+
 // void obPoolDestroy(pool);
 
 
@@ -274,6 +382,15 @@ struct orbit_pool *orbit_pool_create_at(struct orbit_module *ob,
  * `free` and `realloc`.  For scenarios that does not need free or realloc,
  * unsetting this option can help save space used in the underlying memory
  * region.  This option shall not be changed after the creation.
+ *
+ * Blocks of ORBIT_LARGE_BLOCK bytes or more are placed in whole pages.
+ * Freeing one drops its pages (madvise(MADV_DONTNEED)) and leaves a hole
+ * that is skipped by orbit_call and reused by later large blocks.  Small
+ * objects are never reclaimed.
+ *
+ * Without "use_meta", allocation is a lock-free compare-and-swap on the
+ * external size field.  `lockfree` can be cleared right after creation to
+ * fall back to the spinlock, e.g. for comparison in benchmarks.
  */
 struct orbit_allocator {
 	void *start;		/* Underlying memory region */
@@ -281,8 +398,20 @@ struct orbit_allocator {
 	size_t *allocated;	/* External pointer to allocated size */
 	pthread_spinlock_t lock;	/* alloc needs to be thread-safe */
 	bool use_meta;
+	bool lockfree;		/* Bump the size without taking the lock */
+	size_t tcache_size;	/* Per-thread chunk size, 0 if disabled */
+	struct alloc_group *groups;	/* Open allocation groups */
+	unsigned long epoch;	/* Bumped on release to drop cached chunks */
+	struct orbit_chain_member *chain;	/* Set if part of a pool chain */
+	unsigned long id;	/* Unique id used to look up per-thread caches */
+	struct alloc_large *large;	/* Page runs of large blocks */
+	struct orbit_pool *pool;	/* Set if created from a pool */
+	size_t *meta_table;	/* Out-of-line object sizes, NULL if inline */
+	size_t mark;		/* Latest mark or release, see below */
 };
 
+#define ORBIT_LARGE_BLOCK (4 * 4096)
+
 /* Create an allocator */
 struct orbit_allocator *orbit_allocator_create(void *start, size_t length,
 		size_t *allocated, bool use_meta);
@@ -292,6 +421,65 @@ void orbit_allocator_destroy(struct orbit_allocator *alloc);
 /* Create an allocator using underlying pool */
 struct orbit_allocator *orbit_allocator_from_pool(struct orbit_pool *pool, bool use_meta);
 
+/*
+ * Enable per-thread allocation caches on an allocator.
+ *
+ * Each thread reserves `chunk_size` bytes from the shared region at a time
+ * and serves small allocations from its own chunk without taking the
+ * allocator lock.  Allocations larger than half a chunk still go to the
+ * shared region directly.
+ *
+ * `*allocated` accounts for whole reserved chunks, so the snapshot length
+ * may overshoot the bytes actually handed out by at most one chunk per
+ * allocating thread.  Pass 0 to disable the caches again.
+ *
+ * A thread holds chunks of up to 8 allocators at a time.  Allocations from
+ * further allocators go to the shared region until a slot is free.
+ *
+ * This should be called before other threads start allocating.
+ */
+int orbit_allocator_set_tcache(struct orbit_allocator *alloc, size_t chunk_size);
+
+/*
+ * Keep the sizes of a "use_meta" allocator out of line.
+ *
+ * Sizes are stored in a side table mapped outside of the allocator's region
+ * instead of in a header before each object.  Data pages then hold only
+ * user bytes, objects keep their natural alignment, and the side table is
+ * not part of any snapshot.  The table reserves one word per
+ * ORBIT_ALLOC_ALIGN bytes of address space, backed lazily on first write.
+ *
+ * Returns -1 if the allocator does not use meta or has already allocated.
+ */
+int orbit_allocator_set_meta_ool(struct orbit_allocator *alloc);
+
+/*
+ * Mark and release allocations as an arena.
+ *
+ * orbit_allocator_mark() returns the current allocated size.  After all
+ * objects allocated since the mark are no longer needed (e.g. the orbit_call
+ * that used them has returned), orbit_allocator_release() rolls the allocated
+ * size back to the mark.  Later allocations then reuse the same pages and the
+ * snapshot length does not keep growing.
+ *
+ * Both mark and release drop the chunks held by per-thread caches and open
+ * allocation groups, so that objects allocated after a mark always lie
+ * beyond it.  For the same reason, large blocks freed below the latest mark
+ * leave holes that are not reused until an earlier mark is released, and
+ * never move the allocated size back below the mark.
+ * The caller needs to make sure no other thread is allocating from the
+ * allocator concurrently.
+ *
+ * Release returns 0 on success, or -1 if the mark is beyond the allocated
+ * size.
+ */
+size_t orbit_allocator_mark(struct orbit_allocator *alloc);
+int orbit_allocator_release(struct orbit_allocator *alloc, size_t mark);
+
+/* Default alignment of allocated objects */
+#define ORBIT_ALLOC_ALIGN	8
+#define ORBIT_CACHELINE		64
+
 void *__orbit_alloc(struct orbit_allocator *alloc, size_t size,
 			const char *file, int line);
 static inline void *__orbit_calloc(struct orbit_allocator *alloc, size_t size,
@@ -301,12 +489,193 @@ static inline void *__orbit_calloc(struct orbit_allocator *alloc, size_t size,
 }
 #define orbit_alloc(alloc, size) \
 	__orbit_alloc(alloc, size, __FILE__, __LINE__)
+
+/*
+ * Allocate in an allocation group.
+ *
+ * Objects with the same `group_id` are packed into the same page-aligned
+ * page runs instead of landing in allocation order, so that writes to one
+ * logical entity (e.g. a transaction and its locks) dirty as few pages as
+ * possible.  Group ids are arbitrary; a small number of groups are kept open
+ * at a time, and reopening an evicted group starts a new page run.
+ */
+void *__orbit_alloc_in_group(struct orbit_allocator *alloc,
+			unsigned long group_id, size_t size,
+			const char *file, int line);
+#define orbit_alloc_in_group(alloc, group_id, size) \
+	__orbit_alloc_in_group(alloc, group_id, size, __FILE__, __LINE__)
+
+/*
+ * Allocate with an explicit alignment, which must be a power of two.
+ *
+ * Allocating with 4096 alignment starts the object on its own snapshot page.
+ * With "use_meta", the header is placed right before the aligned object.
+ * Returns NULL if `align` is not a power of two.
+ */
+void *__orbit_alloc_aligned(struct orbit_allocator *alloc, size_t size,
+			size_t align, const char *file, int line);
+#define orbit_alloc_aligned(alloc, size, align) \
+	__orbit_alloc_aligned(alloc, size, align, __FILE__, __LINE__)
+
+/*
+ * Allocate an object that does not share cache lines with other objects.
+ *
+ * This is useful for hot counters or locks in pools that are updated by
+ * different threads, to avoid false sharing.
+ */
+void *__orbit_alloc_isolated(struct orbit_allocator *alloc, size_t size,
+			const char *file, int line);
+#define orbit_alloc_isolated(alloc, size) \
+	__orbit_alloc_isolated(alloc, size, __FILE__, __LINE__)
 #define orbit_calloc(alloc, size) \
 	__orbit_calloc(alloc, size, __FILE__, __LINE__)
 void orbit_free(struct orbit_allocator *alloc, void *ptr);
+/* Grows in place if the block is the last one allocated, or has slack in
+ * its pages.  Otherwise the data is moved to a new block. */
 void *orbit_realloc(struct orbit_allocator *alloc, void *oldptr, size_t newsize);
+
+/*
+ * Like orbit_alloc, orbit_alloc_aligned and orbit_realloc, but return NULL
+ * with errno set to ENOMEM when the pool (or every pool of a chain) is full,
+ * instead of aborting.  A failed realloc leaves the old block as is.
+ *
+ * For callers that must survive running out of space, e.g. a malloc
+ * replacement or a std::pmr memory resource.
+ */
+void *__orbit_try_alloc(struct orbit_allocator *alloc, size_t size,
+			const char *file, int line);
+void *__orbit_try_alloc_aligned(struct orbit_allocator *alloc, size_t size,
+			size_t align, const char *file, int line);
+#define orbit_try_alloc(alloc, size) \
+	__orbit_try_alloc(alloc, size, __FILE__, __LINE__)
+#define orbit_try_alloc_aligned(alloc, size, align) \
+	__orbit_try_alloc_aligned(alloc, size, align, __FILE__, __LINE__)
+void *orbit_try_realloc(struct orbit_allocator *alloc, void *oldptr,
+		size_t newsize);
+/*
+ * Grow an array to hold at least `need` bytes, e.g. for vectors in a pool.
+ * `*capacity` is the current size of the block in bytes (0 if `ptr` is NULL)
+ * and is updated.  The capacity at least doubles so that moved blocks leave
+ * at most as many dead bytes behind as the array holds.
+ */
+void *orbit_grow(struct orbit_allocator *alloc, void *ptr, size_t *capacity,
+		size_t need);
+/* Size of an allocated object, or 0 if the allocator does not track sizes */
+size_t orbit_alloc_usable_size(struct orbit_allocator *alloc, void *ptr);
 #define orbit_allocated_by(ptr, alloc) \
-	(alloc != NULL && (ptr >= alloc->start) && (ptr < alloc->start + alloc->length))
+	((alloc) != NULL && (const char*)(ptr) >= (const char*)(alloc)->start && \
+	 (const char*)(ptr) < (const char*)(alloc)->start + (alloc)->length)
+
+/*
+ * Thread-local allocator scope.
+ *
+ * Each thread has a stack of allocators.  Code that allocates on behalf of
+ * others, e.g. the malloc shim in liborbit-preload, allocates from the top
+ * of the current thread's stack, and falls back to the heap if the stack is
+ * empty or the top is NULL.  Pushing NULL therefore suspends routing in an
+ * inner scope.
+ *
+ * Push returns -1 if the stack is full or too many distinct allocators have
+ * been pushed, pop returns -1 if it is empty.
+ *
+ * orbit_alloc_scope_owner() finds which pushed allocator (or member of its
+ * pool chain) a pointer was allocated from, or NULL if none.  Allocators
+ * are forgotten once destroyed.  orbit_alloc_scope_remember() makes an
+ * allocator known to it without pushing, e.g. a process-wide default.
+ */
+#define ORBIT_SCOPE_MAX 16
+
+int orbit_alloc_scope_push(struct orbit_allocator *alloc);
+int orbit_alloc_scope_pop(void);
+struct orbit_allocator *orbit_alloc_scope_current(void);
+struct orbit_allocator *orbit_alloc_scope_owner(const void *ptr);
+int orbit_alloc_scope_remember(struct orbit_allocator *alloc);
+
+/*
+ * Allocation-site profiler.
+ *
+ * When started, one allocation is sampled every `sample_bytes` bytes
+ * allocated by a thread, and attributed to its call site (file and line of
+ * orbit_alloc and friends) and pool.  Each sample stands for `sample_bytes`
+ * bytes, so the report estimates which call sites make up the snapshot
+ * ranges.  Use 1 to record every allocation exactly.
+ *
+ * Unsampled allocations only pay for a thread-local counter update.
+ */
+struct orbit_alloc_site {
+	const char *file;
+	int line;
+	void *pool;		/* Start of the allocator region */
+	size_t bytes;		/* Estimated bytes allocated */
+	size_t count;		/* Estimated number of allocations */
+};
+
+/* Start sampling.  Returns -1 if sample_bytes is 0. */
+int orbit_alloc_profile_start(size_t sample_bytes);
+/* Stop sampling.  Collected data is kept until reset. */
+void orbit_alloc_profile_stop(void);
+void orbit_alloc_profile_reset(void);
+/* Copy at most `max` sites into `sites`.  Returns the number copied. */
+size_t orbit_alloc_profile_get(struct orbit_alloc_site *sites, size_t max);
+/* Print per-pool totals and per-site numbers sorted by bytes. */
+void orbit_alloc_profile_dump(FILE *out);
+
+/* ===== Pool chain ===== */
+
+#define ORBIT_CHAIN_MAX 64	/* Maximum number of pools in a chain */
+
+struct orbit_pool_chain;
+
+struct orbit_chain_member {
+	struct orbit_pool *pool;
+	struct orbit_allocator *alloc;
+	struct orbit_pool_chain *chain;
+	bool dirty;	/* Written since the last orbit_call_chain, accessed
+			   atomically */
+};
+
+/*
+ * A chain of pools that grows on demand.
+ *
+ * The first pool can be sized tight for cache locality.  When the member
+ * being allocated from is full, allocations spill over to the next member,
+ * and a new pool (of `pool_size`, or larger for big objects) is created when
+ * there is none.  Thus allocations only abort when no more pools can be
+ * created.
+ *
+ * orbit_call_chain only snapshots members that have been written since the
+ * last call.  Allocating from a member marks it as written; data modified in
+ * place needs to be marked with orbit_pool_chain_touch.  Unmarked members
+ * keep the content from their last snapshot in the orbit.
+ */
+struct orbit_pool_chain {
+	struct orbit_module *ob;
+	size_t pool_size;	/* Size of pools created on demand */
+	bool use_meta;
+	size_t npool;
+	size_t cur;		/* Member currently allocated from */
+	pthread_spinlock_t lock;	/* Protects growing the chain */
+	struct orbit_chain_member members[ORBIT_CHAIN_MAX];
+};
+
+/* Create a chain with a first pool of `pool_size` */
+struct orbit_pool_chain *orbit_pool_chain_create(struct orbit_module *ob,
+		size_t pool_size, bool use_meta);
+/*
+ * Get the allocator of the chain.  Allocating from it (or from the allocator
+ * of any member) allocates from the current member.
+ */
+struct orbit_allocator *orbit_pool_chain_allocator(struct orbit_pool_chain *chain);
+/* Mark the member containing `ptr` as written */
+void orbit_pool_chain_touch(struct orbit_pool_chain *chain, void *ptr);
+
+/* orbit_call and orbit_call_async with the written members of a chain */
+long orbit_call_chain(struct orbit_module *module,
+		struct orbit_pool_chain *chain,
+		orbit_entry func, void *arg, size_t argsize);
+int orbit_call_chain_async(struct orbit_module *module, unsigned long flags,
+		struct orbit_pool_chain *chain,
+		orbit_entry func, void *arg, size_t argsize, struct orbit_task *task);
 
 /* ===== Scratch ADT ===== */
 
@@ -325,8 +694,47 @@ struct orbit_scratch {
 	size_t size_limit;
 	size_t count;	/* Number of elements */
 	struct orbit_allocator *any_alloc;  /* allocator used by open_any */
+	struct orbit_scratch_ctx *ctx;	/* context the scratch was created in */
+	unsigned long flags;	/* ORBIT_SCRATCH_* */
+	size_t flush_threshold;	/* see orbit_scratch_set_autoflush() */
+	size_t tail;		/* offset + 1 of the packed or batch record
+				   being pushed to */
+	size_t sub;		/* position in the orbit_packed being read */
+	void *sub_addr;		/* end of the update before `sub` */
+	void *packed_last;	/* end of the last update packed at `tail` */
+	struct orbit_module *orbit;	/* orbit a received scratch came from */
+};
+
+/* Append an offset index when sent, see orbit_scratch_seal() */
+#define ORBIT_SCRATCH_INDEX	(1<<0)
+/*
+ * Push updates of up to ORBIT_PACKED_MAX bytes into ORBIT_PACKED records
+ * with a few bytes of header each, instead of a full orbit_repr.
+ *
+ * orbit_apply() applies a packed record as one, while orbit_scratch_first()
+ * and orbit_scratch_next() still go through its updates one at a time.
+ */
+#define ORBIT_SCRATCH_PACKED	(1<<1)
+
+/*
+ * Offset index at the end of a sent scratch.
+ *
+ * `count` entries of struct orbit_index_entry start at offset `table`, and
+ * this footer takes the last bytes of the sent pages.
+ */
+struct orbit_index_entry {
+	unsigned int offset;	/* Offset of the record from scratch ptr */
+	unsigned int type;	/* enum orbit_type of the record */
 };
 
+struct orbit_index_footer {
+	unsigned long magic;
+	unsigned int count;
+	unsigned int table;
+};
+
+#define ORBIT_INDEX_MAGIC 0x786564696f62726fUL	/* "orbiodex" */
+
 /* TODO: specialized query APIs */
 union orbit_result {
 	unsigned long retval;
@@ -338,7 +746,16 @@ union orbit_result {
  *
  * Typically we use orbit pool mode "MOVE" for performance reason.
  *
- * This needs to be called before creating a scratch.
+ * This needs to be called before creating a scratch.  The first page of
+ * the pool is used to tell the orbit which scratches the main program has
+ * finished (see orbit_recvv_finish()), so the pool needs at least two free
+ * pages.
+ * Each orbit sending from the global pool is counted separately there, and
+ * orbit_call passes that page only to orbits already counted.
+ *
+ * When the pool is used up, scratches are created in more pools of the
+ * same size, up to a ring of 8.  A pool is reused once all scratches sent
+ * from it are finished.
  */
 int orbit_scratch_set_pool(struct orbit_pool *pool);
 
@@ -347,19 +764,130 @@ int orbit_scratch_set_pool(struct orbit_pool *pool);
  *
  * After each successful sendv(), the caller needs to call this again to
  * allocate a new scratch space.
+ *
+ * Returns -1 if all pools of the ring still hold unfinished scratches.
  */
 int orbit_scratch_create(struct orbit_scratch *s);
+
+/*
+ * Scratch context bound to an orbit.
+ *
+ * Like the global pool of orbit_scratch_set_pool(), but for one module, so
+ * that different orbits do not share scratch space.  orbit_call on the
+ * module tells its orbit which scratches have been finished.
+ *
+ * Several threads can create and send scratches from the same context at
+ * the same time.  Each scratch reserves its space with a compare-and-swap
+ * on the pool, and the unused end is given back on sendv if no other
+ * scratch was reserved after it.
+ */
+struct orbit_scratch_ctx;
+
+struct orbit_scratch_ctx *orbit_scratch_ctx_create(struct orbit_module *ob,
+		struct orbit_pool *pool);
+void orbit_scratch_ctx_destroy(struct orbit_scratch_ctx *ctx);
+/*
+ * Get a scratch space of `size` bytes (rounded up to pages) from a
+ * context.  A `size` of 0 takes the rest of the current pool, as
+ * orbit_scratch_create() does.
+ */
+int orbit_scratch_create_in(struct orbit_scratch_ctx *ctx,
+		struct orbit_scratch *s, size_t size);
+/*
+ * Give back a scratch that will not be sent.  A pool of the ring is not
+ * reused while it still has scratches that are neither sent nor discarded.
+ */
+int orbit_scratch_discard(struct orbit_scratch *s);
+/*
+ * Send a scratch in segments as it is built.
+ *
+ * Once `threshold` bytes of it are used, or a push does not fit in the
+ * rest, the scratch is sent with orbit_sendv() and continues in a new
+ * segment from its context, of twice the threshold (rounded up to pages)
+ * if that is smaller than the last one.  The main program receives
+ * each segment from orbit_recvv() as a scratch of its own, so it can apply
+ * them while the orbit is still running.  A `threshold` of 0 turns this
+ * off, which is the default.
+ *
+ * Only for scratches created from a context, e.g. orbit_scratch_create().
+ * Returns 0 on success, otherwise -1.
+ */
+int orbit_scratch_set_autoflush(struct orbit_scratch *s, size_t threshold);
+/*
+ * Send what has been pushed so far and continue in a new segment, as
+ * autoflush does.  Does nothing if the scratch is empty.
+ *
+ * Returns 0 on success.  If sending fails, returns -1 and the scratch is
+ * left as is.  If it was sent but no new space can be had, returns -1 and
+ * the scratch is left empty with no space.
+ */
+int orbit_scratch_flush(struct orbit_scratch *s);
 // void orbit_scratch_free(orbit_scratch *s);
 
 /* Push orbit_operation to scratch */
 int orbit_scratch_push_operation(struct orbit_scratch *s,
 		orbit_operation_func func, size_t argc, unsigned long argv[]);
-/* Push orbit_update to scratch */
+/*
+ * Push one call of a batch operation with `argc` arguments.
+ *
+ * If the last record pushed is a batch of the same `func` and `argc`, the
+ * arguments are appended to it, otherwise a new ORBIT_BATCH record is
+ * started.  Applying the record calls `func` once with all the tuples, so
+ * thousands of identical operations cost one call instead of one each.
+ *
+ * Like a packed record, a batch counts as one element of the scratch.
+ */
+int orbit_scratch_push_batch(struct orbit_scratch *s,
+		orbit_batch_func func, size_t argc, unsigned long argv[]);
+/*
+ * Push orbit_update to scratch.
+ *
+ * Returns the new number of elements, or -1 if there is no room.  With
+ * ORBIT_SCRATCH_PACKED, an update added to the packed record being pushed
+ * to does not add an element, so the count returned stays the same.
+ */
 int orbit_scratch_push_update(struct orbit_scratch *s, void *ptr, size_t length);
+/*
+ * Push a store of `value` to `ptr`.  The record has a fixed size and is
+ * applied with a single store, without copying from `ptr` when pushed.
+ */
+int orbit_scratch_push_u8(struct orbit_scratch *s, uint8_t *ptr, uint8_t value);
+int orbit_scratch_push_u16(struct orbit_scratch *s, uint16_t *ptr, uint16_t value);
+int orbit_scratch_push_u32(struct orbit_scratch *s, uint32_t *ptr, uint32_t value);
+int orbit_scratch_push_u64(struct orbit_scratch *s, uint64_t *ptr, uint64_t value);
 /* Push orbit_any to scratch.  Returns a space of size `length`.
  * If ptr is non-NULL, it will copy the data into that area.
  * If ptr is NULL, it returns `length` space from scratch to be filled by the caller. */
 void *orbit_scratch_push_any(struct orbit_scratch *s, void *ptr, size_t length);
+/*
+ * Push an update of `length` bytes at `ptr` as a delta against `orig`,
+ * which holds what the main program has there (e.g., a copy taken when the
+ * orbit call started).  Only the bytes that differ are stored, so a large
+ * range with few changes takes little space.
+ *
+ * Falls back to a plain orbit_update when that would be smaller.
+ */
+int orbit_scratch_push_delta(struct orbit_scratch *s, void *ptr,
+		const void *orig, size_t length);
+/*
+ * Compact the updates of a scratch before sending it.
+ *
+ * Between two non-update records (operations, any), overlapping or adjacent
+ * updates are merged into one, keeping the last value pushed for each byte.
+ * Updates are never moved across other records, so operations still see
+ * the same memory when applied.  Updates in ORBIT_PACKED records are merged
+ * like the others; with ORBIT_SCRATCH_PACKED, merged ranges of up to
+ * ORBIT_PACKED_MAX bytes are packed again.
+ *
+ * Objects built in ORBIT_ANY records (see orbit_scratch_push_any() and
+ * orbit_scratch_open_any()) may point into them, so ANY records are never
+ * moved: only the records after the last ANY record are compacted.
+ *
+ * Returns the new number of elements, or -1 and sets errno: ENOMEM if out
+ * of memory, ENOSPC if unpacking updates would not fit in the scratch.  The
+ * scratch is left as it was on error.
+ */
+int orbit_scratch_compact(struct orbit_scratch *s);
 
 #if defined(__cplusplus) && __cplusplus >= 201103L
 
@@ -434,10 +962,19 @@ int orbit_scratch_close_any(struct orbit_scratch *s);
  * Note: After success send, the scratch will not be accessible any more!
  * If the send fails, this scratch is still accessible, and the caller can
  * optionally update it and resend.
- * If the caller decides not to send it, the caller needs to call create()
- * again to request a new scratch space.
+ * If the caller decides not to send it, the caller needs to call
+ * orbit_scratch_discard() and create() again to request a new scratch space.
  */
 int orbit_sendv(struct orbit_scratch *s);
+/*
+ * Get a scratch ready to send, and return the number of bytes to send.
+ * Called by orbit_sendv().
+ *
+ * With ORBIT_SCRATCH_INDEX in s->flags, this appends an offset index of
+ * all records if there is room for it.  Otherwise any stale index in the
+ * sent pages is cleared.
+ */
+size_t orbit_scratch_seal(struct orbit_scratch *s);
 
 /*
  * Receive in the main program.  Expect a scratch or return value from
@@ -448,6 +985,15 @@ int orbit_sendv(struct orbit_scratch *s);
  * Returns -1 on error, and sets errno.
  */
 int orbit_recvv(union orbit_result *result, struct orbit_task *task);
+/*
+ * Tell the orbit that the main program is done with a received scratch, so
+ * that its space can be reused.  The orbit sees this from the next
+ * orbit_call on.  Scratches should be finished in the order received.
+ *
+ * Returns -1 if the scratch was not received, or if the control page has no
+ * room left to count one more orbit.
+ */
+int orbit_recvv_finish(struct orbit_scratch *s);
 
 /*
  * Terminate the orbit identified by gobid for the current process.
@@ -466,15 +1012,54 @@ bool orbit_gone(struct orbit_module *ob);
 
 enum orbit_type orbit_apply(struct orbit_scratch *s, bool yield);
 enum orbit_type orbit_apply_one(struct orbit_scratch *s, bool yield);
+/*
+ * Like orbit_apply(s, false), but spreads runs of updates (including delta
+ * and store records) over `nthreads` threads, including the caller.  No
+ * more than 64 threads, nor more than the run has updates, are used.
+ *
+ * Operations and other records are barriers: all updates before one are
+ * applied before it runs, and none after it.  A run of updates is only
+ * split if no two of its updates overlap and it is large enough to be
+ * worth the threads; otherwise it is applied in order.
+ */
+enum orbit_type orbit_apply_parallel(struct orbit_scratch *s, int nthreads);
 enum orbit_type orbit_skip(struct orbit_scratch *s, bool yield);
 enum orbit_type orbit_skip_one(struct orbit_scratch *s, bool yield);
 
+/*
+ * Iterate through a scratch without applying it.  Updates in an
+ * ORBIT_PACKED record are returned one by one as ORBIT_UPDATE, in a buffer
+ * of the calling thread that is valid until the next call.
+ */
 struct orbit_repr *orbit_scratch_first(struct orbit_scratch *s);
 struct orbit_repr *orbit_scratch_next(struct orbit_scratch *s);
 static inline bool orbit_scratch_empty(struct orbit_scratch *s) {
        return s->count == 0;
 }
 
+/*
+ * Random access into a received scratch.
+ *
+ * These use the offset index if the sender set ORBIT_SCRATCH_INDEX, and
+ * otherwise walk the records from the start.  Record numbers count from the
+ * first record sent, regardless of what has been applied.
+ */
+bool orbit_scratch_indexed(const struct orbit_scratch *s);
+/* Get the i-th record, or NULL if out of range */
+struct orbit_repr *orbit_scratch_at(const struct orbit_scratch *s, size_t i);
+/* Count the records of one type */
+size_t orbit_scratch_count_type(const struct orbit_scratch *s,
+		enum orbit_type type);
+/*
+ * Make `part` a view of `n` records of `s` starting from the i-th, so that
+ * different parts can be applied independently.  Only `s` itself should be
+ * passed to orbit_recvv_finish().
+ *
+ * Returns 0 on success, or -1 if out of range.
+ */
+int orbit_scratch_slice(const struct orbit_scratch *s, size_t i, size_t n,
+		struct orbit_scratch *part);
+
 #ifdef __cplusplus
 }
 
@@ -490,41 +1075,89 @@ void *__orbit_allocate_wrapper(orbit_allocator *alloc, std::size_t n, std::size_
 void __orbit_deallocate_wrapper(orbit_allocator *alloc, void *ptr, std::size_t n) NOEXCEPT;
 
 extern orbit_allocator *__global_allocator;
+/* Throws std::length_error if the allocator cannot be tracked for frees,
+ * see orbit_alloc_scope_remember(), and keeps the old one. */
 void set_global_allocator(orbit_allocator *alloc);
 
+/* The allocator of the innermost alloc_scope of this thread, or the global
+ * allocator if there is none.  NULL means the heap. */
+orbit_allocator *current_allocator();
+/* The allocator `ptr` was allocated from, or NULL if from the heap */
+orbit_allocator *__allocator_of(void *ptr);
+
+/* Route global_allocator and global_new_operator of this thread to `alloc`
+ * until the end of the scope, e.g. `orbit::alloc_scope guard(alloc);` */
+class alloc_scope {
+public:
+	explicit alloc_scope(orbit_allocator *alloc) {
+		if (alloc && orbit_alloc_scope_remember(alloc) != 0)
+			throw std::length_error(
+				"orbit::alloc_scope too many allocators to track");
+		if (orbit_alloc_scope_push(alloc) != 0)
+			throw std::length_error("orbit::alloc_scope nested too deep");
+	}
+	~alloc_scope() { orbit_alloc_scope_pop(); }
+private:
+	alloc_scope(const alloc_scope &);
+	alloc_scope &operator=(const alloc_scope &);
+};
+
 template<class T>
 struct global_allocator {
 public:
 	typedef T value_type;
+	global_allocator() {}
+	template<class U>
+	global_allocator(const global_allocator<U> &) {}
 	T* allocate(std::size_t n) {
-		if (__global_allocator) {
+		if (orbit_allocator *alloc = current_allocator()) {
 			return static_cast<T*>(__orbit_allocate_wrapper(
-					__global_allocator, n, sizeof(T)));
+					alloc, n, sizeof(T)));
 		}
 		return std::allocator<T>().allocate(n);
 	}
+	/* Objects go back to where they came from, whatever the scope is now */
 	void deallocate(T *p, std::size_t n) NOEXCEPT {
-		if (__global_allocator)
-			return __orbit_deallocate_wrapper(__global_allocator, p, n);
+		if (orbit_allocator *alloc = __allocator_of(p))
+			return __orbit_deallocate_wrapper(alloc, p, n);
 		std::allocator<T>().deallocate(p, n);
 	}
-	bool operator==(const global_allocator &rhs) const { return true; }
-	bool operator!=(const global_allocator &rhs) const { return true; }
+	/* All instances allocate from the same place */
+	template<class U>
+	bool operator==(const global_allocator<U> &) const { return true; }
+	template<class U>
+	bool operator!=(const global_allocator<U> &) const { return false; }
 };
 
 /* A shim for new and delete operator. Inherit this struct to make the
- * subclass use orbit global allocator by default. */
+ * subclass use the current allocator (see current_allocator()) by default.
+ * Without one, objects are allocated from the heap. */
 struct global_new_operator {
 	static void* operator new(std::size_t size);
+	static void* operator new[](std::size_t size);
 	static void operator delete(void *ptr) NOEXCEPT;
+	static void operator delete[](void *ptr) NOEXCEPT;
 };
 
 // Note: this is currently only a wrapper on the orbit_alloc.
 // Destructing this struct won't destroy the orbit_allocator.
+//
+// The allocator is stateful: copies and rebound copies allocate from the
+// same orbit_allocator, and containers carry it along on copy, move and
+// swap.  A null orbit_allocator allocates from the heap.
 template<class T>
 struct allocator {
 	typedef T value_type;
+#if __cplusplus >= 201103L
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+#endif
+
+	allocator() : alloc(NULL) {}
 	allocator(orbit_allocator *alloc) : alloc(alloc) {}
+	template<class U>
+	allocator(const allocator<U> &other) : alloc(other.get()) {}
 	~allocator() {}
 	T* allocate(std::size_t n) {
 		if (alloc)
@@ -536,9 +1169,94 @@ struct allocator {
 			return __orbit_deallocate_wrapper(alloc, p, n);
 		std::allocator<T>().deallocate(p, n);
 	}
+	orbit_allocator *get() const { return alloc; }
+
+	template<class U>
+	bool operator==(const allocator<U> &rhs) const { return alloc == rhs.get(); }
+	template<class U>
+	bool operator!=(const allocator<U> &rhs) const { return alloc != rhs.get(); }
+private:
+	orbit_allocator *alloc;
+};
+
+#if __cplusplus >= 201103L
+/* Containers in an orbit_allocator, e.g. `orbit::vector<int> v(alloc);` */
+template<class T>
+using vector = std::vector<T, allocator<T>>;
+
+template<class T>
+using list = std::list<T, allocator<T>>;
+
+template<class K, class V, class Compare = std::less<K>>
+using map = std::map<K, V, Compare, allocator<std::pair<const K, V>>>;
+
+template<class K, class V, class Hash = std::hash<K>,
+	 class KeyEqual = std::equal_to<K>>
+using unordered_map = std::unordered_map<K, V, Hash, KeyEqual,
+	allocator<std::pair<const K, V>>>;
+
+using string = std::basic_string<char, std::char_traits<char>, allocator<char>>;
+#endif
+
+#ifdef ORBIT_HAVE_MEMORY_RESOURCE
+// A std::pmr::memory_resource on top of an orbit_allocator, which can be
+// backed by a pool or by a scratch record from orbit_scratch_open_any().
+// Like allocator<T>, it does not own the orbit_allocator.
+class memory_resource : public std::pmr::memory_resource {
+public:
+	explicit memory_resource(orbit_allocator *alloc) noexcept : alloc(alloc) {}
+	orbit_allocator *get() const noexcept { return alloc; }
 private:
+	void *do_allocate(std::size_t bytes, std::size_t align) override {
+		void *p = align <= ORBIT_ALLOC_ALIGN ? orbit_try_alloc(alloc, bytes)
+				: orbit_try_alloc_aligned(alloc, bytes, align);
+		if (p == nullptr)
+			throw std::bad_alloc();
+		return p;
+	}
+	void do_deallocate(void *p, std::size_t bytes, std::size_t align) override {
+		(void)bytes;
+		(void)align;
+		orbit_free(alloc, p);
+	}
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+		const memory_resource *rhs =
+			dynamic_cast<const memory_resource*>(&other);
+		return rhs && rhs->alloc == alloc;
+	}
+
 	orbit_allocator *alloc;
 };
+#endif
+
+#if __cplusplus >= 201103L
+namespace detail {
+template<std::size_t N> struct scratch_store;
+template<> struct scratch_store<1> { typedef uint8_t type;
+	static int push(orbit_scratch *s, type *p, type v) { return orbit_scratch_push_u8(s, p, v); } };
+template<> struct scratch_store<2> { typedef uint16_t type;
+	static int push(orbit_scratch *s, type *p, type v) { return orbit_scratch_push_u16(s, p, v); } };
+template<> struct scratch_store<4> { typedef uint32_t type;
+	static int push(orbit_scratch *s, type *p, type v) { return orbit_scratch_push_u32(s, p, v); } };
+template<> struct scratch_store<8> { typedef uint64_t type;
+	static int push(orbit_scratch *s, type *p, type v) { return orbit_scratch_push_u64(s, p, v); } };
+}  // namespace detail
+
+// Push a store of `value` to `ptr`, e.g. `orbit::push(&s, &lock->mark, true)`.
+// T is any trivially copyable type of 1, 2, 4 or 8 bytes.
+template<class T>
+int push(orbit_scratch *s, T *ptr, T value)
+{
+	static_assert(std::is_trivially_copyable<T>::value,
+		"orbit::push needs a trivially copyable type");
+	static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 ||
+		sizeof(T) == 8, "orbit::push needs a 1, 2, 4 or 8 byte type");
+	typedef detail::scratch_store<sizeof(T)> store;
+	typename store::type bits;
+	std::memcpy(&bits, &value, sizeof(T));
+	return store::push(s, reinterpret_cast<typename store::type*>(ptr), bits);
+}
+#endif
 
 #undef NOEXCEPT
 
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
@@ -11,6 +13,9 @@
 #include <sys/syscall.h>
 #include <sys/mman.h>
 #include <signal.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define SYS_ORBIT_CREATE	436
 #define SYS_ORBIT_CALL		437
@@ -48,32 +53,120 @@ enum orbit_state
 	}
 
 _define_round_up(4)
+_define_round_up(8)
 _define_round_up(4096)
 #define round_up_page round_up_4096
 
 #undef _define_round_up
 
+/*
+ * Alignment of records in a scratch.  The orbit and the main program run
+ * the same binary, so this only has to be chosen at build time.  Payloads
+ * start sizeof(struct orbit_repr) after their record, so anything above 8
+ * would align headers only.
+ */
+#ifndef ORBIT_RECORD_ALIGN
+#define ORBIT_RECORD_ALIGN 8
+#endif
+#if ORBIT_RECORD_ALIGN != 4 && ORBIT_RECORD_ALIGN != 8
+#error "ORBIT_RECORD_ALIGN must be 4 or 8"
+#endif
+
+static inline size_t round_up_record(size_t value)
+{
+	return (value + ORBIT_RECORD_ALIGN - 1) &
+		~(size_t)(ORBIT_RECORD_ALIGN - 1);
+}
+
+/* Number of pools a scratch ring can grow to */
+#define ORBIT_SCRATCH_RING 8
+
+/* Finished count of one orbit.  Keyed by the address of its module, which
+ * the orbit also knows since it was allocated before the fork. */
+struct scratch_ctl_entry {
+	unsigned long key;	/* 0 if unused; entries are claimed in order */
+	unsigned long finished;	/* Scratches applied by the main program */
+};
+
+#define ORBIT_SCRATCH_ORBITS (4096 / sizeof(struct scratch_ctl_entry))
+
+/* Written by the main program, read by the orbits from their snapshot.
+ * Each orbit sends its own scratches, so each has its own count. */
+struct scratch_ctl {
+	struct scratch_ctl_entry orbits[ORBIT_SCRATCH_ORBITS];
+};
+
+struct scratch_slot {
+	struct orbit_pool *pool;
+	size_t base;		/* Offset of the first scratch in the pool */
+	unsigned long last_seq;	/* Last scratch sent from this pool */
+	unsigned long pending;	/* Scratches created but not yet sent */
+};
+
+struct orbit_scratch_ctx {
+	struct orbit_module *ob;	/* NULL for the global context */
+	pthread_spinlock_t lock;	/* Protects moving along the ring */
+	/* Ring of pools used to create scratch.  The first one is given by
+	 * the user, the others are created on demand in the same size. */
+	struct scratch_slot ring[ORBIT_SCRATCH_RING];
+	size_t cur;
+	unsigned long seq;	/* Scratches sent so far */
+	/* First page of the user's pool, shared with the main program */
+	struct scratch_ctl *ctl;
+};
+
 static struct {
-	/* Underlying global pool used to create scratch. */
-	struct orbit_pool *scratch_pool;
+	/* Global context used by orbit_scratch_create() */
+	struct orbit_scratch_ctx scratch;
 } info;
 
-static void scratch_renew(size_t size_hint)
+/* Entry of `ob` in the control page, claimed if not there and `claim` */
+static struct scratch_ctl_entry *ctl_entry(struct scratch_ctl *ctl,
+		const struct orbit_module *ob, bool claim)
 {
-	// FIXME: should create the pool for a specific orbit
-	if (/* info.auto_renew && */ !info.scratch_pool)
-		info.scratch_pool = orbit_pool_create(NULL, size_hint);
+	unsigned long key = (unsigned long)ob;
+
+	for (size_t i = 0; key && i < ORBIT_SCRATCH_ORBITS; ++i) {
+		struct scratch_ctl_entry *e = &ctl->orbits[i];
+		unsigned long cur = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+
+		if (cur == 0) {
+			if (!claim)
+				return NULL;
+			if (__atomic_compare_exchange_n(&e->key, &cur, key,
+					false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE))
+				return e;
+		}
+		if (cur == key)
+			return e;
+	}
+	return NULL;
+}
+
+/* A new module may reuse the address of a destroyed one; start its count
+ * over.  The entry is kept so that lookups can stop at the first unused. */
+static void scratch_ctl_reset(const struct orbit_module *ob)
+{
+	struct scratch_ctl_entry *e;
+
+	if (!info.scratch.ctl)
+		return;
+	e = ctl_entry(info.scratch.ctl, ob, false);
+	if (e)
+		__atomic_store_n(&e->finished, 0, __ATOMIC_RELEASE);
 }
 
 static void info_init(void)
 {
 	// FIXME: should create the pool for a specific orbit
-	(void)scratch_renew;
-	info.scratch_pool = orbit_pool_create(NULL, 1024 * 1024);
+	orbit_scratch_set_pool(orbit_pool_create(NULL, 1024 * 1024));
 }
 
 long orbit_taskid;
 static bool orbit_context = false;
+/* In an orbit, the module the main program knows it by */
+static struct orbit_module *orbit_self;
 
 struct orbit_module *orbit_create(const char *module_name,
 		orbit_entry entry_func, void*(*init_func)(void))
@@ -99,6 +192,7 @@ struct orbit_module *orbit_create(const char *module_name,
 		/* We are now in child, we should run the function  */
 		/* FIXME: we should create scratch in orbit! */
 		orbit_context = true;  /* Should this be in info_init()? */
+		orbit_self = ob;
 		// info_init();
 		(void)info_init;
 		if (init_func)
@@ -127,6 +221,8 @@ struct orbit_module *orbit_create(const char *module_name,
 	ob->lobid = lobid;
 	ob->gobid = gobid;
 	ob->entry_func = entry_func;
+	ob->scratch_ctx = NULL;
+	scratch_ctl_reset(ob);
 	if (module_name)
 		strncpy(ob->name, module_name, ORBIT_NAME_LEN);
 	else
@@ -160,25 +256,52 @@ static long orbit_call_inner(struct orbit_module *module, unsigned long flags,
 		orbit_entry func, void *arg, size_t argsize)
 {
 	long ret;
+	size_t nrange = 0, n = 0;
+	size_t counts[npool];
 
-	/* This requries C99.  We can limit number of pools otherwise.*/
-	struct pool_range_kernel pools_kernel[npool];
+	/* Pools with freed large blocks are sent as several ranges. */
+	for (size_t i = 0; i < npool; ++i) {
+		counts[i] = orbit_pool_ranges(pools[i], NULL, 0);
+		nrange += counts[i];
+	}
 
-	struct orbit_call_args_kernel args = { flags, module->gobid,
-			npool, pools_kernel, func, arg, argsize, };
+	/* This requries C99.  We can limit number of pools otherwise.*/
+	struct orbit_range ranges[nrange];
+	struct pool_range_kernel pools_kernel[nrange + 1];
 
 	for (size_t i = 0; i < npool; ++i) {
 		struct orbit_pool *pool = pools[i];
-		unsigned long start = (unsigned long)pool->rawptr;
 		/* TODO: directly using `used` is not actually safe.
 		 * However, if we hold all alloc->lock until orbit_call ends,
-		 * it might be too long. */
-		unsigned long length = (unsigned long)round_up_page(pool->used);
-		pools_kernel[i].start = start;
-		pools_kernel[i].end = start + length;
-		pools_kernel[i].mode = pool->mode;
+		 * it might be too long.  Holes created since counting are
+		 * covered by the last range. */
+		size_t got = orbit_pool_ranges(pool, ranges + n, counts[i]);
+		if (got > counts[i])
+			got = counts[i];
+		for (size_t j = n; j < n + got; ++j) {
+			pools_kernel[j].start = (unsigned long)ranges[j].start;
+			pools_kernel[j].end = (unsigned long)ranges[j].end;
+			pools_kernel[j].mode = pool->mode;
+		}
+		n += got;
 	}
 
+	/* Let the orbit know which scratches it can recycle.  Other orbits
+	 * have nothing in the global pool's page until they send from it. */
+	struct scratch_ctl *ctl = module->scratch_ctx ?
+		module->scratch_ctx->ctl : info.scratch.ctl;
+	if (ctl && !module->scratch_ctx && !ctl_entry(ctl, module, false))
+		ctl = NULL;
+	if (ctl) {
+		pools_kernel[n].start = (unsigned long)ctl;
+		pools_kernel[n].end = (unsigned long)ctl + 4096;
+		pools_kernel[n].mode = ORBIT_COW;
+		++n;
+	}
+
+	struct orbit_call_args_kernel args = { flags, module->gobid,
+			n, pools_kernel, func, arg, argsize, };
+
 	ret = syscall(SYS_ORBIT_CALL, &args);
 	// printf("In orbit_call_inner, ret=%ld\n", ret);
 	return ret;
@@ -286,6 +409,7 @@ struct orbit_pool *orbit_pool_create_at(struct orbit_module *ob,
 	pool->length = init_pool_size;
 	pool->used = 0;
 	pool->mode = ORBIT_COW;
+	pool->alloc = NULL;
 
 	return pool;
 
@@ -300,6 +424,138 @@ struct alloc_meta {
 	size_t size;
 };
 
+/* Number of allocators a thread can cache chunks for at the same time. */
+#define ORBIT_TCACHE_SLOTS 8
+/* When all slots are taken, one is evicted every this many allocations that
+ * could not be cached, so that slots of allocators that are no longer used
+ * are taken back.  The rest of the evicted chunk is lost. */
+#define ORBIT_TCACHE_EVICT 64
+
+/* A chunk reserved by one thread from the shared region of an allocator. */
+struct tcache_slot {
+	unsigned long id;	/* Allocator id, 0 if unused */
+	unsigned long epoch;	/* Allocator epoch the chunk belongs to */
+	char *cur;
+	char *end;
+};
+
+static __thread struct tcache_slot tcache[ORBIT_TCACHE_SLOTS];
+static __thread unsigned long tcache_misses;
+
+/* The slot of this thread holding a chunk of `alloc`, or NULL */
+static struct tcache_slot *tcache_find(struct orbit_allocator *alloc)
+{
+	for (int i = 0; i < ORBIT_TCACHE_SLOTS; ++i) {
+		if (tcache[i].id == alloc->id)
+			return &tcache[i];
+	}
+	return NULL;
+}
+
+/* Number of allocation groups an allocator can keep open at the same time,
+ * and the size of the page run each group packs its objects into. */
+#define ORBIT_ALLOC_GROUPS 64
+#define ORBIT_GROUP_CHUNK 4096
+
+struct alloc_group {
+	unsigned long id;
+	char *cur;
+	char *end;	/* NULL if no page run has been reserved */
+};
+static unsigned long alloc_next_id = 1;
+
+/* A run of whole pages */
+struct alloc_run {
+	char *start;
+	size_t length;
+};
+
+/* Page runs sorted by address */
+struct run_list {
+	struct alloc_run *runs;
+	size_t n;
+	size_t cap;
+};
+
+struct alloc_large {
+	struct run_list live;	/* Large blocks in use */
+	struct run_list holes;	/* Freed runs below the cursor */
+};
+
+/* Index of the first run that starts after `addr` */
+static size_t run_upper(struct run_list *list, const char *addr)
+{
+	size_t lo = 0, hi = list->n;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (list->runs[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Make room for one more run, so that run_insert() cannot fail */
+static int run_grow(struct run_list *list)
+{
+	struct alloc_run *runs;
+	size_t cap;
+
+	if (list->n < list->cap)
+		return 0;
+	cap = list->cap ? list->cap * 2 : 16;
+	runs = (struct alloc_run*)realloc(list->runs, cap * sizeof(*runs));
+	if (runs == NULL)
+		return -1;
+	list->runs = runs;
+	list->cap = cap;
+	return 0;
+}
+
+static void run_insert(struct run_list *list, size_t i, struct alloc_run run)
+{
+	memmove(&list->runs[i + 1], &list->runs[i],
+		(list->n - i) * sizeof(run));
+	list->runs[i] = run;
+	++list->n;
+}
+
+static void run_remove(struct run_list *list, size_t i)
+{
+	--list->n;
+	memmove(&list->runs[i], &list->runs[i + 1],
+		(list->n - i) * sizeof(struct alloc_run));
+}
+
+/* Start of the first whole page at or after `addr` */
+static inline char *page_after(const char *addr)
+{
+	return (char*)round_up_page((uintptr_t)addr);
+}
+
+/* Forget all runs at or beyond `end` */
+static void large_trim(struct alloc_large *large, const char *end)
+{
+	struct alloc_run *hole;
+	char *page = (char*)((uintptr_t)end & ~(uintptr_t)4095);
+
+	while (large->live.n && large->live.runs[large->live.n - 1].start >= end)
+		--large->live.n;
+	while (large->holes.n &&
+	       large->holes.runs[large->holes.n - 1].start >= page)
+		--large->holes.n;
+
+	/* A hole merged across `end` keeps only its pages below it, as
+	 * what comes after `end` is handed out again. */
+	if (large->holes.n) {
+		hole = &large->holes.runs[large->holes.n - 1];
+		if (hole->start + hole->length > page)
+			hole->length = page - hole->start;
+	}
+}
+
 struct orbit_allocator *orbit_allocator_create(void *start, size_t length,
 		size_t *allocated, bool use_meta)
 {
@@ -319,6 +575,16 @@ struct orbit_allocator *orbit_allocator_create(void *start, size_t length,
 	alloc->length = length;
 	alloc->allocated = allocated;
 	alloc->use_meta = use_meta;
+	alloc->lockfree = !use_meta;
+	alloc->tcache_size = 0;
+	alloc->groups = NULL;
+	alloc->epoch = 0;
+	alloc->chain = NULL;
+	alloc->id = __atomic_fetch_add(&alloc_next_id, 1, __ATOMIC_RELAXED);
+	alloc->large = NULL;
+	alloc->pool = NULL;
+	alloc->meta_table = NULL;
+	alloc->mark = 0;
 
 	return alloc;
 
@@ -327,262 +593,2347 @@ lock_init_fail:
 	return NULL;
 }
 
+static void scope_forget(struct orbit_allocator *alloc);
+
+static size_t meta_table_size(struct orbit_allocator *alloc)
+{
+	return round_up_page(alloc->length / ORBIT_ALLOC_ALIGN * sizeof(size_t));
+}
+
 void orbit_allocator_destroy(struct orbit_allocator *alloc)
 {
+	struct tcache_slot *slot = tcache_find(alloc);
+
+	/* Free the slot of this thread.  Other threads evict theirs later. */
+	if (slot != NULL)
+		memset(slot, 0, sizeof(*slot));
+	scope_forget(alloc);
+	if (alloc->pool && alloc->pool->alloc == alloc)
+		alloc->pool->alloc = NULL;
 	pthread_spin_destroy(&alloc->lock);
+	free(alloc->groups);
+	if (alloc->meta_table)
+		munmap(alloc->meta_table, meta_table_size(alloc));
+	if (alloc->large) {
+		free(alloc->large->live.runs);
+		free(alloc->large->holes.runs);
+		free(alloc->large);
+	}
 	memset(alloc, 0, sizeof(*alloc));
 	free(alloc);
 }
 
 struct orbit_allocator *orbit_allocator_from_pool(struct orbit_pool *pool, bool use_meta)
 {
-	return orbit_allocator_create(pool->rawptr, pool->length, &pool->used, use_meta);
+	struct orbit_allocator *alloc;
+
+	alloc = orbit_allocator_create(pool->rawptr, pool->length, &pool->used,
+			use_meta);
+	if (alloc) {
+		alloc->pool = pool;
+		pool->alloc = alloc;
+	}
+	return alloc;
 }
 
-/* TODO: currently we are ony using a linear allocating mechanism.
- * In the future we will need to design an allocation algorithm aiming for
- * compactness of related data. */
-void *__orbit_alloc(struct orbit_allocator *alloc, size_t size,
-	const char *file, int line)
+int orbit_allocator_set_tcache(struct orbit_allocator *alloc, size_t chunk_size)
 {
-	void *ptr;
-	int ret;
-
-	if (alloc->use_meta)
-		size += sizeof(struct alloc_meta);
-
-	ret = pthread_spin_lock(&alloc->lock);
-	if (ret != 0) return NULL;
+	if (chunk_size > alloc->length)
+		return -1;
+	alloc->tcache_size = chunk_size;
+	return 0;
+}
 
-	if (size > alloc->length - *alloc->allocated) {
-		fprintf(stderr, "Pool %p is full.\n", alloc);
-		abort();
-		return NULL;
-	}
+int orbit_allocator_set_meta_ool(struct orbit_allocator *alloc)
+{
+	void *table;
 
-	ptr = (char*)alloc->start + *alloc->allocated;
+	if (!alloc->use_meta || alloc->meta_table || *alloc->allocated != 0)
+		return -1;
 
-	*alloc->allocated += size;
+	table = mmap(NULL, meta_table_size(alloc), PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (table == MAP_FAILED)
+		return -1;
+	alloc->meta_table = (size_t*)table;
+	return 0;
+}
 
-	pthread_spin_unlock(&alloc->lock);
+/* Make all threads and groups reserve new chunks from the current cursor.
+ * The caller must hold the allocator lock. */
+static void alloc_drop_chunks(struct orbit_allocator *alloc)
+{
+	__atomic_add_fetch(&alloc->epoch, 1, __ATOMIC_RELEASE);
+	if (alloc->groups)
+		memset(alloc->groups, 0,
+		       ORBIT_ALLOC_GROUPS * sizeof(struct alloc_group));
+}
 
-#define OUTPUT_ORBIT_ALLOC 0
-#if OUTPUT_ORBIT_ALLOC
-	void __mysql_orbit_alloc_callback(void *, size_t, const char *, int);
-	__mysql_orbit_alloc_callback(ptr, size, file, line);
-#else
-	(void)file;
-	(void)line;
-#endif
+size_t orbit_allocator_mark(struct orbit_allocator *alloc)
+{
+	size_t mark;
 
-	if (alloc->use_meta)
-		*(struct alloc_meta*)ptr = (struct alloc_meta) {
-			.size = size - sizeof(struct alloc_meta),
-		};
+	if (pthread_spin_lock(&alloc->lock) != 0)
+		return *alloc->allocated;
 
-	return (struct alloc_meta*)ptr + 1;
-}
+	/* Objects allocated after the mark must not come from chunks that
+	 * were reserved before it. */
+	alloc_drop_chunks(alloc);
+	mark = __atomic_load_n(alloc->allocated, __ATOMIC_ACQUIRE);
+	alloc->mark = mark;
 
-void orbit_free(struct orbit_allocator *alloc, void *ptr)
-{
-	/* Let it leak. */
-	(void)alloc;
-	(void)ptr;
-	/* In real allocator:
-	if (!alloc->use_meta)
-		return; */
+	pthread_spin_unlock(&alloc->lock);
+	return mark;
 }
 
-void *orbit_realloc(struct orbit_allocator *alloc, void *oldptr, size_t newsize)
+int orbit_allocator_release(struct orbit_allocator *alloc, size_t mark)
 {
-	void *mem;
-	struct alloc_meta *meta;
+	int ret = 0;
 
-	if (!oldptr || !alloc->use_meta)
-		return orbit_alloc(alloc, newsize);
+	if (pthread_spin_lock(&alloc->lock) != 0)
+		return -1;
 
-	meta = (struct alloc_meta*)oldptr - 1;
-	if (meta->size >= newsize) {
-		meta->size = newsize;
-		return oldptr;
+	if (mark > *alloc->allocated) {
+		ret = -1;
+		goto out;
 	}
 
-	mem = orbit_alloc(alloc, newsize);
-	memcpy(mem, oldptr, meta->size);
-	orbit_free(alloc, oldptr);
-	return mem;
+	__atomic_store_n(alloc->allocated, mark, __ATOMIC_RELEASE);
+	alloc->mark = mark;
+	/* Chunks cached by threads and groups may lie beyond the mark. */
+	alloc_drop_chunks(alloc);
+	if (alloc->large)
+		large_trim(alloc->large, (char*)alloc->start + mark);
+out:
+	pthread_spin_unlock(&alloc->lock);
+	return ret;
 }
 
+/* Padding needed so that `addr + off` is aligned to `align`. */
+static inline size_t align_pad(uintptr_t addr, size_t align, size_t off)
+{
+	return -(addr + off) & (align - 1);
+}
 
-/* ===== Scratch ADT ===== */
-
-/* Set global pool used to create orbit_scratch. */
-int orbit_scratch_set_pool(struct orbit_pool *pool)
+/* Size of the header in front of each allocated block. */
+static inline size_t alloc_hdr(struct orbit_allocator *alloc)
 {
-	if (!pool)
-		return -1;
-	info.scratch_pool = pool;
-	return 0;
+	return alloc->use_meta && !alloc->meta_table ?
+		sizeof(struct alloc_meta) : 0;
 }
 
-int orbit_scratch_create(struct orbit_scratch *s)
+/* Bump the shared region.  The block starts at the returned pointer, and
+ * `off` bytes into the block is aligned to `align`.
+ * The caller must hold the allocator lock. */
+static void *alloc_reserve_locked(struct orbit_allocator *alloc, size_t size,
+		size_t align, size_t off)
 {
-	struct orbit_pool *info_s = info.scratch_pool;
+	size_t used = *alloc->allocated;
+	size_t pad = align_pad((uintptr_t)alloc->start + used, align, off);
 
-	if (!info_s || info_s->length == info_s->used)
-		return -1;
+	if (pad > alloc->length - used || size > alloc->length - used - pad)
+		return NULL;
 
-	s->ptr = (char*)info_s->rawptr + info_s->used;
-	s->size_limit = info_s->length - info_s->used;
-	s->cursor = 0;
-	s->count = 0;
-	s->any_alloc = NULL;
+	*alloc->allocated = used + pad + size;
+	return (char*)alloc->start + used + pad;
+}
 
-	return 0;
+/* Lock-free version of alloc_reserve().  The size field is only advanced by
+ * a successful CAS, so a failed reservation leaves no state behind. */
+static void *alloc_reserve_lockfree(struct orbit_allocator *alloc, size_t size,
+		size_t align, size_t off)
+{
+	size_t old = __atomic_load_n(alloc->allocated, __ATOMIC_RELAXED);
+	size_t pad;
+
+	do {
+		pad = align_pad((uintptr_t)alloc->start + old, align, off);
+		if (pad > alloc->length - old || size > alloc->length - old - pad)
+			return NULL;
+	} while (!__atomic_compare_exchange_n(alloc->allocated, &old,
+			old + pad + size, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return (char*)alloc->start + old + pad;
 }
 
-struct orbit_allocator *orbit_scratch_open_any(struct orbit_scratch *s, bool use_meta)
+/* Reserve `size` bytes from the shared region, see alloc_reserve_locked().
+ * Returns NULL if full. */
+static void *alloc_reserve(struct orbit_allocator *alloc, size_t size,
+		size_t align, size_t off)
 {
-	struct orbit_repr *record;
-	size_t rec_size = sizeof(struct orbit_repr);
+	void *ptr;
 
-	orbit_scratch_close_any(s);
+	if (alloc->lockfree)
+		return alloc_reserve_lockfree(alloc, size, align, off);
 
-	if (rec_size > s->size_limit - s->cursor)
+	if (pthread_spin_lock(&alloc->lock) != 0)
 		return NULL;
 
-	record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
-	record->type = ORBIT_ANY;
-	record->any.length = 0;  /* Unknown size, filled by `conclude' */
+	ptr = alloc_reserve_locked(alloc, size, align, off);
 
-	s->any_alloc = orbit_allocator_create(
-			record->any.data,
-			s->size_limit - (record->any.data - (char*)s->ptr),
-			&record->any.length,
-			use_meta);
+	pthread_spin_unlock(&alloc->lock);
 
-	return s->any_alloc;
+	return ptr;
 }
 
-int orbit_scratch_close_any(struct orbit_scratch *s)
+/* Extend the shared region by `grow` bytes if it currently ends at `end`. */
+static bool alloc_extend(struct orbit_allocator *alloc, char *end, size_t grow)
 {
-	struct orbit_repr *record;
-
-	if (!s->any_alloc)
-		return s->count;
+	size_t off = end - (char*)alloc->start;
+	bool ok;
+
+	if (grow > alloc->length - off)
+		return false;
+
+	if (alloc->lockfree)
+		return __atomic_compare_exchange_n(alloc->allocated, &off,
+				off + grow, false, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED);
+
+	if (pthread_spin_lock(&alloc->lock) != 0)
+		return false;
+	ok = *alloc->allocated == off;
+	if (ok)
+		*alloc->allocated = off + grow;
+	pthread_spin_unlock(&alloc->lock);
+	return ok;
+}
 
-	record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+/* Bump a chunk owned by a thread or a group.  Returns NULL if the chunk does
+ * not have enough space left. */
+static void *chunk_bump(char **cur, char *end, size_t size, size_t off)
+{
+	size_t pad;
+	char *ptr;
 
-	s->cursor += sizeof(struct orbit_repr) + record->any.length;
-	s->cursor = round_up_4(s->cursor);
+	if (*cur == NULL)
+		return NULL;
 
-	orbit_allocator_destroy(s->any_alloc);
-	s->any_alloc = NULL;
+	pad = align_pad((uintptr_t)*cur, ORBIT_ALLOC_ALIGN, off);
+	ptr = *cur + pad;
+	if (pad > (size_t)(end - *cur) || size > (size_t)(end - ptr))
+		return NULL;
 
-	return ++s->count;
+	*cur = ptr + size;
+	return ptr;
 }
 
-int orbit_scratch_push_update(struct orbit_scratch *s, void *ptr, size_t length)
+/* Find the slot of `alloc`, or take one that holds no space.  Returns NULL
+ * if all slots hold chunks of other allocators. */
+static struct tcache_slot *tcache_claim(struct orbit_allocator *alloc)
 {
-	struct orbit_repr *record;
-	size_t rec_size = sizeof(struct orbit_repr) + length;
+	struct tcache_slot *slot = NULL;
 
-	orbit_scratch_close_any(s);
-
-	if (rec_size > s->size_limit - s->cursor)
-		return -1;	/* No enough space */
+	for (int i = 0; i < ORBIT_TCACHE_SLOTS; ++i) {
+		if (tcache[i].id == alloc->id)
+			return &tcache[i];
+		if (slot == NULL && tcache[i].cur == tcache[i].end)
+			slot = &tcache[i];
+	}
 
-	record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+	if (slot == NULL) {
+		if (++tcache_misses % ORBIT_TCACHE_EVICT != 0)
+			return NULL;
+		slot = &tcache[tcache_misses / ORBIT_TCACHE_EVICT %
+			       ORBIT_TCACHE_SLOTS];
+	}
+	slot->id = alloc->id;
+	slot->epoch = alloc->epoch;
+	slot->cur = slot->end = NULL;
+	return slot;
+}
 
-	record->type = ORBIT_UPDATE;
-	record->update.ptr = ptr;
-	record->update.length = length;
-	memcpy(record->update.data, ptr, length);
+/* Allocate from the chunk this thread reserved from `alloc`.  The shared
+ * lock is only taken when the chunk needs to be refilled. */
+static void *tcache_alloc(struct orbit_allocator *alloc, size_t size)
+{
+	struct tcache_slot *slot;
+	size_t off = alloc_hdr(alloc);
+	char *ptr;
+
+	if (size > alloc->tcache_size / 2)
+		return alloc_reserve(alloc, size, ORBIT_ALLOC_ALIGN, off);
+
+	/* Do not evict the chunk of another allocator, its remaining space
+	 * would be left unused. */
+	slot = tcache_claim(alloc);
+	if (slot == NULL)
+		return alloc_reserve(alloc, size, ORBIT_ALLOC_ALIGN, off);
+
+	if (slot->epoch != __atomic_load_n(&alloc->epoch, __ATOMIC_ACQUIRE)) {
+		/* The chunk has been released */
+		slot->epoch = alloc->epoch;
+		slot->cur = slot->end = NULL;
+	}
 
-	s->cursor += rec_size;
-	s->cursor = round_up_4(s->cursor);
+	ptr = (char*)chunk_bump(&slot->cur, slot->end, size, off);
+	if (ptr == NULL) {
+		char *chunk = (char*)alloc_reserve(alloc, alloc->tcache_size,
+				ORBIT_ALLOC_ALIGN, 0);
+		/* Less than a chunk left, allocate the exact size instead. */
+		if (chunk == NULL)
+			return alloc_reserve(alloc, size, ORBIT_ALLOC_ALIGN, off);
+		slot->cur = chunk;
+		slot->end = chunk + alloc->tcache_size;
+		ptr = (char*)chunk_bump(&slot->cur, slot->end, size, off);
+	}
 
-	return ++s->count;
+	return ptr;
 }
 
-void *orbit_scratch_push_any(struct orbit_scratch *s, void *ptr, size_t length)
+/* Allocate from the page run of group `group_id`.  Objects of one group are
+ * packed together so that writes to them dirty as few pages as possible. */
+static void *group_alloc(struct orbit_allocator *alloc, size_t size,
+		unsigned long group_id)
 {
-	struct orbit_repr *record;
-	size_t rec_size = sizeof(struct orbit_repr) + length;
+	struct alloc_group *group;
+	size_t off = alloc_hdr(alloc);
+	char *ptr = NULL;
 
-	orbit_scratch_close_any(s);
-
-	if (rec_size > s->size_limit - s->cursor)
-		return NULL;	/* No enough space */
+	/* Large objects get their own pages anyway. */
+	if (size > ORBIT_GROUP_CHUNK / 2)
+		return alloc_reserve(alloc, size, ORBIT_ALLOC_ALIGN, off);
 
-	record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+	if (pthread_spin_lock(&alloc->lock) != 0)
+		return NULL;
 
-	record->type = ORBIT_ANY;
-	record->any.length = length;
-	// Act as preallocating fixed area
-	if (ptr) memcpy(record->any.data, ptr, length);
+	if (alloc->groups == NULL) {
+		alloc->groups = (struct alloc_group*)calloc(ORBIT_ALLOC_GROUPS,
+				sizeof(struct alloc_group));
+		if (alloc->groups == NULL)
+			goto out;
+	}
 
-	s->cursor += rec_size;
-	s->cursor = round_up_4(s->cursor);
-	++s->count;
+	group = &alloc->groups[group_id % ORBIT_ALLOC_GROUPS];
+	if (group->id != group_id) {
+		/* Another group takes over this slot.  The rest of its run is
+		 * left unused. */
+		group->id = group_id;
+		group->cur = group->end = NULL;
+	}
 
-	return record->any.data;
+	ptr = (char*)chunk_bump(&group->cur, group->end, size, off);
+	if (ptr == NULL) {
+		char *chunk = (char*)(alloc->lockfree ?
+			alloc_reserve_lockfree(alloc, ORBIT_GROUP_CHUNK,
+					       ORBIT_GROUP_CHUNK, 0) :
+			alloc_reserve_locked(alloc, ORBIT_GROUP_CHUNK,
+					     ORBIT_GROUP_CHUNK, 0));
+		if (chunk == NULL)
+			goto out;
+		group->cur = chunk;
+		group->end = chunk + ORBIT_GROUP_CHUNK;
+		ptr = (char*)chunk_bump(&group->cur, group->end, size, off);
+	}
+out:
+	pthread_spin_unlock(&alloc->lock);
+	/* Out of whole pages, try to fit the object anywhere. */
+	return ptr ? ptr : alloc_reserve(alloc, size, ORBIT_ALLOC_ALIGN, off);
 }
 
-int orbit_scratch_push_operation(struct orbit_scratch *s,
-		orbit_operation_func func, size_t argc, unsigned long argv[])
+/* Allocate a large block in a run of whole pages, reusing a hole if one is
+ * big enough.  `size` includes the header. */
+static void *large_alloc(struct orbit_allocator *alloc, size_t size)
 {
-	struct orbit_repr *record;
-	size_t length = argc * sizeof(*argv);
-	size_t rec_size = sizeof(struct orbit_repr) + length;
+	struct alloc_large *large;
+	size_t length = round_up_page(size);
+	char *ptr = NULL, *floor;
 
-	orbit_scratch_close_any(s);
+	if (pthread_spin_lock(&alloc->lock) != 0)
+		return NULL;
 
-	if (rec_size > s->size_limit - s->cursor)
-		return -1;	/* No enough space */
+	if (alloc->large == NULL) {
+		alloc->large = (struct alloc_large*)calloc(1,
+				sizeof(struct alloc_large));
+		if (alloc->large == NULL)
+			goto out;
+	}
+	large = alloc->large;
+	if (run_grow(&large->live) != 0 || run_grow(&large->holes) != 0)
+		goto out;
+
+	/* Only the part of a hole beyond the latest mark can be used, so
+	 * that a release does not leave the block behind. */
+	floor = page_after((char*)alloc->start + alloc->mark);
+	for (size_t i = 0; i < large->holes.n; ++i) {
+		struct alloc_run *hole = &large->holes.runs[i];
+		char *from = hole->start > floor ? hole->start : floor;
+		char *hole_end = hole->start + hole->length;
+
+		if (from >= hole_end || (size_t)(hole_end - from) < length)
+			continue;
+		ptr = from;
+		if (from == hole->start) {
+			hole->start += length;
+			hole->length -= length;
+			if (hole->length == 0)
+				run_remove(&large->holes, i);
+		} else {
+			hole->length = from - hole->start;
+			if (from + length < hole_end)
+				run_insert(&large->holes, i + 1,
+					(struct alloc_run) {
+						.start = from + length,
+						.length = hole_end - from - length,
+					});
+		}
+		break;
+	}
+	if (ptr == NULL) {
+		ptr = (char*)(alloc->lockfree ?
+			alloc_reserve_lockfree(alloc, length, 4096, 0) :
+			alloc_reserve_locked(alloc, length, 4096, 0));
+		if (ptr == NULL)
+			goto out;
+	}
 
-	record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+	run_insert(&large->live, run_upper(&large->live, ptr),
+		   (struct alloc_run) { .start = ptr, .length = length, });
+out:
+	pthread_spin_unlock(&alloc->lock);
+	return ptr;
+}
 
-	record->type = ORBIT_OPERATION;
-	record->operation.func = func;
-	record->operation.argc = argc;
-	memcpy(record->operation.argv, argv, length);
+/* Turn a freed run into a hole, merging it with its neighbours.  A hole
+ * that ends at the cursor is given back to the bump region instead, down
+ * to the latest mark at most.
+ * The caller must hold the allocator lock and have called run_grow(). */
+static void large_add_hole(struct orbit_allocator *alloc,
+		struct alloc_run run)
+{
+	struct run_list *holes = &alloc->large->holes;
+	size_t i = run_upper(holes, run.start);
+	char *floor = page_after((char*)alloc->start + alloc->mark);
+	char *from;
+	size_t end;
+
+	if (i < holes->n && run.start + run.length == holes->runs[i].start) {
+		run.length += holes->runs[i].length;
+		run_remove(holes, i);
+	}
+	if (i > 0 && holes->runs[i - 1].start + holes->runs[i - 1].length
+			== run.start) {
+		--i;
+		run.start = holes->runs[i].start;
+		run.length += holes->runs[i].length;
+		run_remove(holes, i);
+	}
 
-	s->cursor += rec_size;
-	s->cursor = round_up_4(s->cursor);
+	from = run.start > floor ? run.start : floor;
+	end = run.start + run.length - (char*)alloc->start;
+	if (from < run.start + run.length &&
+	    __atomic_compare_exchange_n(alloc->allocated, &end,
+			from - (char*)alloc->start, false,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		/* Pages below the mark stay a hole */
+		run.length = from - run.start;
+		if (run.length == 0)
+			return;
+	}
 
-	return ++s->count;
+	run_insert(holes, i, run);
 }
 
-static void scratch_trunc(const struct orbit_scratch *s)
+/* End of the page run of a large block, or NULL if `ptr` is not one */
+static char *large_run_end(struct orbit_allocator *alloc, void *ptr)
 {
-	struct orbit_pool *info_s = info.scratch_pool;
+	struct run_list *live;
+	char *end = NULL;
+	size_t i;
 
-	info_s->used += round_up_page(s->cursor);
+	if (alloc->large == NULL || pthread_spin_lock(&alloc->lock) != 0)
+		return NULL;
 
-	if (info_s->used == info_s->length) {
-		/* TODO: unmap safety in the kernel
-		 * If we decide to copy page range at recvv instead of at sendv,
-		 * we need to consider another mechanism to unmap pages. */
-		/* orbit_pool_destroy() */
-		/* munmap(info_s->ptr, info_s->size_limit); */
-		info.scratch_pool = NULL;
-		/* TODO: a mechanism to renew/auto create new pool? */
-		/* scratch_renew(); */
-	}
+	live = &alloc->large->live;
+	i = run_upper(live, (char*)ptr);
+	if (i > 0 && (char*)ptr < live->runs[i - 1].start + live->runs[i - 1].length)
+		end = live->runs[i - 1].start + live->runs[i - 1].length;
+
+	pthread_spin_unlock(&alloc->lock);
+	return end;
 }
 
-int orbit_sendv(struct orbit_scratch *s)
+/* Free a large block.  Returns false if `ptr` is not one. */
+static bool large_free(struct orbit_allocator *alloc, void *ptr)
 {
-	int ret;
-	struct orbit_scratch buf;
-
-	orbit_scratch_close_any(s);
+	struct alloc_large *large;
+	struct alloc_run run;
+	size_t i;
+	bool found = false;
+
+	if (alloc->large == NULL || pthread_spin_lock(&alloc->lock) != 0)
+		return false;
+
+	large = alloc->large;
+	i = run_upper(&large->live, (char*)ptr);
+	if (i == 0)
+		goto out;
+	run = large->live.runs[i - 1];
+	if ((char*)ptr >= run.start + run.length)
+		goto out;
+	found = true;
+	/* Keep the block if the hole cannot be recorded */
+	if (run_grow(&large->holes) != 0)
+		goto out;
+
+	run_remove(&large->live, i - 1);
+	madvise(run.start, run.length, MADV_DONTNEED);
+	large_add_hole(alloc, run);
+out:
+	pthread_spin_unlock(&alloc->lock);
+	return found;
+}
 
-	buf = (struct orbit_scratch) {
+size_t orbit_pool_ranges(struct orbit_pool *pool, struct orbit_range *ranges,
+		size_t max)
+{
+	struct orbit_allocator *alloc = pool->alloc;
+	char *start = (char*)pool->rawptr;
+	char *end = start + round_up_page(pool->used);
+	size_t n = 0;
+
+	if (alloc && alloc->large && pthread_spin_lock(&alloc->lock) == 0) {
+		struct run_list *holes = &alloc->large->holes;
+		for (size_t i = 0; i < holes->n; ++i) {
+			struct alloc_run *hole = &holes->runs[i];
+			if (hole->start >= end)
+				break;
+			if (hole->start > start) {
+				if (n < max)
+					ranges[n] = (struct orbit_range) {
+						start, hole->start, };
+				++n;
+			}
+			start = hole->start + hole->length;
+		}
+		pthread_spin_unlock(&alloc->lock);
+	}
+	if (end > start || n == 0) {
+		if (n < max)
+			ranges[n] = (struct orbit_range) { start, end, };
+		++n;
+	}
+
+	if (n > max && max > 0)
+		ranges[max - 1].end = (char*)pool->rawptr +
+			round_up_page(pool->used);
+	return n;
+}
+
+/* ===== Allocation-site profiler ===== */
+
+#define ORBIT_PROFILE_SITES 1024	/* Must be a power of two */
+
+static struct {
+	size_t rate;		/* Sample every `rate` bytes, 0 if stopped */
+	pthread_spinlock_t lock;	/* Protects the site table */
+	size_t nsite;
+	struct orbit_alloc_site sites[ORBIT_PROFILE_SITES];
+} profile;
+
+static __thread long profile_countdown;
+
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+
+static void profile_init(void)
+{
+	pthread_spin_init(&profile.lock, PTHREAD_PROCESS_PRIVATE);
+}
+
+int orbit_alloc_profile_start(size_t sample_bytes)
+{
+	if (sample_bytes == 0)
+		return -1;
+	pthread_once(&profile_once, profile_init);
+	__atomic_store_n(&profile.rate, sample_bytes, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void orbit_alloc_profile_stop(void)
+{
+	__atomic_store_n(&profile.rate, 0, __ATOMIC_RELEASE);
+}
+
+void orbit_alloc_profile_reset(void)
+{
+	pthread_once(&profile_once, profile_init);
+	pthread_spin_lock(&profile.lock);
+	memset(profile.sites, 0, sizeof(profile.sites));
+	profile.nsite = 0;
+	pthread_spin_unlock(&profile.lock);
+}
+
+static void profile_record(struct orbit_allocator *alloc, size_t size,
+	const char *file, int line, size_t rate)
+{
+	size_t hits = 0, bytes, count;
+	uintptr_t hash;
+
+	/* Every `rate` bytes allocated by this thread trigger one sample, each
+	 * standing for `rate` bytes at the site that crossed it. */
+	profile_countdown -= size;
+	while (profile_countdown < 0) {
+		profile_countdown += rate;
+		++hits;
+	}
+	if (hits == 0)
+		return;
+
+	bytes = hits * rate;
+	count = size >= bytes ? 1 : bytes / size;
+
+	hash = ((uintptr_t)file ^ (uintptr_t)line * 0x9e3779b9UL ^
+		(uintptr_t)alloc->start >> 12) * 0x9e3779b97f4a7c15UL;
+
+	pthread_spin_lock(&profile.lock);
+	for (size_t i = 0; i < ORBIT_PROFILE_SITES; ++i) {
+		struct orbit_alloc_site *site = &profile.sites[
+			(hash + i) & (ORBIT_PROFILE_SITES - 1)];
+		if (site->file == NULL) {
+			if (profile.nsite == ORBIT_PROFILE_SITES - 1)
+				break;	/* Keep one slot empty to end probing */
+			site->file = file;
+			site->line = line;
+			site->pool = alloc->start;
+			++profile.nsite;
+		} else if (site->file != file || site->line != line ||
+			   site->pool != alloc->start) {
+			continue;
+		}
+		site->bytes += bytes;
+		site->count += count;
+		break;
+	}
+	pthread_spin_unlock(&profile.lock);
+}
+
+size_t orbit_alloc_profile_get(struct orbit_alloc_site *sites, size_t max)
+{
+	size_t n = 0;
+
+	pthread_once(&profile_once, profile_init);
+	pthread_spin_lock(&profile.lock);
+	for (size_t i = 0; i < ORBIT_PROFILE_SITES && n < max; ++i)
+		if (profile.sites[i].file)
+			sites[n++] = profile.sites[i];
+	pthread_spin_unlock(&profile.lock);
+
+	return n;
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+	const struct orbit_alloc_site *x = (const struct orbit_alloc_site*)a;
+	const struct orbit_alloc_site *y = (const struct orbit_alloc_site*)b;
+
+	if (x->pool != y->pool)
+		return (uintptr_t)x->pool < (uintptr_t)y->pool ? -1 : 1;
+	if (x->bytes != y->bytes)
+		return x->bytes > y->bytes ? -1 : 1;
+	return 0;
+}
+
+void orbit_alloc_profile_dump(FILE *out)
+{
+	struct orbit_alloc_site *sites;
+	size_t n;
+
+	sites = (struct orbit_alloc_site*)malloc(sizeof(profile.sites));
+	if (sites == NULL)
+		return;
+
+	n = orbit_alloc_profile_get(sites, ORBIT_PROFILE_SITES);
+	qsort(sites, n, sizeof(*sites), site_cmp);
+
+	fprintf(out, "Orbit allocation profile\n");
+	for (size_t i = 0; i < n; ) {
+		size_t j, bytes = 0, count = 0;
+
+		for (j = i; j < n && sites[j].pool == sites[i].pool; ++j) {
+			bytes += sites[j].bytes;
+			count += sites[j].count;
+		}
+		fprintf(out, "pool %p: %lu bytes in %lu allocations\n",
+			sites[i].pool, bytes, count);
+		for (; i < j; ++i)
+			fprintf(out, "  %10lu bytes %8lu allocs  %s:%d\n",
+				sites[i].bytes, sites[i].count,
+				sites[i].file, sites[i].line);
+	}
+
+	free(sites);
+}
+
+/* Common tail of allocation functions.  `size` includes the meta header. */
+static void *alloc_finish(struct orbit_allocator *alloc, void *ptr, size_t size,
+	const char *file, int line)
+{
+	if (ptr == NULL) {
+		fprintf(stderr, "Pool %p is full.\n", alloc);
+		abort();
+		return NULL;
+	}
+
+#define OUTPUT_ORBIT_ALLOC 0
+#if OUTPUT_ORBIT_ALLOC
+	void __mysql_orbit_alloc_callback(void *, size_t, const char *, int);
+	__mysql_orbit_alloc_callback(ptr, size, file, line);
+#endif
+
+	size_t rate = __atomic_load_n(&profile.rate, __ATOMIC_RELAXED);
+	if (rate)
+		profile_record(alloc, size, file, line, rate);
+
+	if (!alloc->use_meta)
+		return ptr;
+
+	if (alloc->meta_table) {
+		alloc->meta_table[((char*)ptr - (char*)alloc->start) /
+				  ORBIT_ALLOC_ALIGN] = size;
+		return ptr;
+	}
+
+	*(struct alloc_meta*)ptr = (struct alloc_meta) {
+		.size = size - sizeof(struct alloc_meta),
+	};
+
+	return (struct alloc_meta*)ptr + 1;
+}
+
+/* Allocate a block of `size` bytes (including header) from one allocator.
+ * Returns NULL if it is full. */
+typedef void *(*alloc_fn)(struct orbit_allocator *alloc, size_t size,
+		unsigned long arg);
+
+static void *plain_alloc(struct orbit_allocator *alloc, size_t size,
+		unsigned long arg)
+{
+	(void)arg;
+	if (size >= ORBIT_LARGE_BLOCK)
+		return large_alloc(alloc, size);
+	if (alloc->tcache_size)
+		return tcache_alloc(alloc, size);
+	return alloc_reserve(alloc, size, ORBIT_ALLOC_ALIGN, alloc_hdr(alloc));
+}
+
+static void *align_alloc(struct orbit_allocator *alloc, size_t size,
+		unsigned long align)
+{
+	return alloc_reserve(alloc, size, align, alloc_hdr(alloc));
+}
+
+static struct orbit_allocator *chain_current(struct orbit_pool_chain *chain);
+static struct orbit_allocator *chain_spill(struct orbit_pool_chain *chain,
+		struct orbit_allocator *full, size_t need);
+
+/* Run `fn` on the allocator, or on the current member if the allocator is
+ * part of a pool chain, spilling over to the next member when full.
+ * Aborts if no space is left, unless `may_fail` is set. */
+static void *alloc_with(struct orbit_allocator *alloc, alloc_fn fn,
+	size_t size, unsigned long arg, bool may_fail,
+	const char *file, int line)
+{
+	void *ptr;
+
+	if (alloc->chain)
+		alloc = chain_current(alloc->chain->chain);
+
+	/* Without a header, an empty block would start where the next one
+	 * does and share its entry in the meta table. */
+	if (size == 0 && alloc->meta_table)
+		size = ORBIT_ALLOC_ALIGN;
+	size += alloc_hdr(alloc);
+
+	while ((ptr = fn(alloc, size, arg)) == NULL && alloc->chain) {
+		struct orbit_allocator *next = chain_spill(alloc->chain->chain,
+				alloc, size + (fn == align_alloc ? arg : 0));
+		if (next == NULL)
+			break;
+		alloc = next;
+	}
+
+	if (ptr && alloc->chain &&
+	    !__atomic_load_n(&alloc->chain->dirty, __ATOMIC_RELAXED))
+		__atomic_store_n(&alloc->chain->dirty, true, __ATOMIC_RELEASE);
+
+	if (ptr == NULL && may_fail) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return alloc_finish(alloc, ptr, size, file, line);
+}
+
+/* Objects are placed linearly in allocation order.  Callers that know which
+ * objects are related can cluster them with orbit_alloc_in_group(). */
+void *__orbit_alloc(struct orbit_allocator *alloc, size_t size,
+	const char *file, int line)
+{
+	return alloc_with(alloc, plain_alloc, size, 0, false, file, line);
+}
+
+void *__orbit_try_alloc(struct orbit_allocator *alloc, size_t size,
+	const char *file, int line)
+{
+	return alloc_with(alloc, plain_alloc, size, 0, true, file, line);
+}
+
+void *__orbit_alloc_in_group(struct orbit_allocator *alloc,
+	unsigned long group_id, size_t size, const char *file, int line)
+{
+	return alloc_with(alloc, group_alloc, size, group_id, false,
+			file, line);
+}
+
+static void *alloc_aligned(struct orbit_allocator *alloc, size_t size,
+	size_t align, bool may_fail, const char *file, int line)
+{
+	if (align == 0 || (align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (align < ORBIT_ALLOC_ALIGN)
+		align = ORBIT_ALLOC_ALIGN;
+
+	return alloc_with(alloc, align_alloc, size, align, may_fail,
+			file, line);
+}
+
+void *__orbit_alloc_aligned(struct orbit_allocator *alloc, size_t size,
+	size_t align, const char *file, int line)
+{
+	return alloc_aligned(alloc, size, align, false, file, line);
+}
+
+void *__orbit_try_alloc_aligned(struct orbit_allocator *alloc, size_t size,
+	size_t align, const char *file, int line)
+{
+	return alloc_aligned(alloc, size, align, true, file, line);
+}
+
+void *__orbit_alloc_isolated(struct orbit_allocator *alloc, size_t size,
+	const char *file, int line)
+{
+	/* Pad to whole cache lines so that the next object does not share
+	 * the last line.  The header of a meta block sits in the line before
+	 * and is only written at allocation. */
+	size = (size + ORBIT_CACHELINE - 1) & ~(size_t)(ORBIT_CACHELINE - 1);
+	return __orbit_alloc_aligned(alloc, size, ORBIT_CACHELINE, file, line);
+}
+
+static struct orbit_allocator *chain_member_of(struct orbit_pool_chain *chain,
+		const void *ptr);
+
+void orbit_free(struct orbit_allocator *alloc, void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	if (alloc->chain) {
+		alloc = chain_member_of(alloc->chain->chain, ptr);
+		if (alloc == NULL)
+			return;
+	}
+
+	/* Large blocks give their pages back.  Small objects leak. */
+	large_free(alloc, ptr);
+}
+
+/* Where the size of `ptr` is kept.  The allocator must use meta. */
+static size_t *meta_size(struct orbit_allocator *alloc, void *ptr)
+{
+	if (alloc->chain) {
+		struct orbit_allocator *owner =
+			chain_member_of(alloc->chain->chain, ptr);
+		if (owner)
+			alloc = owner;
+	}
+	if (alloc->meta_table)
+		return &alloc->meta_table[((char*)ptr - (char*)alloc->start) /
+					  ORBIT_ALLOC_ALIGN];
+	return &((struct alloc_meta*)ptr - 1)->size;
+}
+
+/* Try to grow a block without moving it */
+static bool realloc_in_place(struct orbit_allocator *alloc, char *ptr,
+		size_t oldsize, size_t newsize)
+{
+	struct tcache_slot *slot;
+	char *end = ptr + oldsize;
+	char *run_end;
+
+	if (alloc->chain)
+		alloc = chain_member_of(alloc->chain->chain, ptr);
+	if (alloc == NULL)
+		return false;
+
+	/* Large blocks can use the rest of their last page */
+	run_end = large_run_end(alloc, ptr);
+	if (run_end)
+		return newsize <= (size_t)(run_end - ptr);
+
+	/* The block is the last one in this thread's chunk */
+	slot = tcache_find(alloc);
+	if (alloc->tcache_size && slot != NULL &&
+	    slot->epoch == __atomic_load_n(&alloc->epoch, __ATOMIC_ACQUIRE) &&
+	    slot->cur == end) {
+		if (newsize - oldsize > (size_t)(slot->end - end))
+			return false;
+		slot->cur = ptr + newsize;
+		return true;
+	}
+
+	return alloc_extend(alloc, end, newsize - oldsize);
+}
+
+static void *realloc_with(struct orbit_allocator *alloc, void *oldptr,
+		size_t newsize, bool may_fail)
+{
+	void *mem;
+	size_t *size;
+
+	if (!oldptr || !alloc->use_meta)
+		return alloc_with(alloc, plain_alloc, newsize, 0, may_fail,
+				__FILE__, __LINE__);
+
+	size = meta_size(alloc, oldptr);
+	if (*size >= newsize ||
+	    realloc_in_place(alloc, (char*)oldptr, *size, newsize)) {
+		*size = newsize;
+		return oldptr;
+	}
+
+	mem = alloc_with(alloc, plain_alloc, newsize, 0, may_fail,
+			__FILE__, __LINE__);
+	if (mem == NULL)
+		return NULL;	/* The old block is left as is */
+	memcpy(mem, oldptr, *size);
+	orbit_free(alloc, oldptr);
+	return mem;
+}
+
+void *orbit_realloc(struct orbit_allocator *alloc, void *oldptr, size_t newsize)
+{
+	return realloc_with(alloc, oldptr, newsize, false);
+}
+
+void *orbit_try_realloc(struct orbit_allocator *alloc, void *oldptr,
+		size_t newsize)
+{
+	return realloc_with(alloc, oldptr, newsize, true);
+}
+
+void *orbit_grow(struct orbit_allocator *alloc, void *ptr, size_t *capacity,
+		size_t need)
+{
+	size_t oldcap = ptr ? *capacity : 0;
+	size_t cap;
+	void *mem;
+
+	if (ptr && oldcap >= need)
+		return ptr;
+
+	cap = oldcap * 2 > need ? oldcap * 2 : need;
+	if (alloc->use_meta) {
+		mem = orbit_realloc(alloc, ptr, cap);
+	} else if (ptr && realloc_in_place(alloc, (char*)ptr, oldcap, cap)) {
+		mem = ptr;
+	} else {
+		/* Without meta the old size is only known to the caller */
+		mem = orbit_alloc(alloc, cap);
+		if (ptr) {
+			memcpy(mem, ptr, oldcap);
+			orbit_free(alloc, ptr);
+		}
+	}
+
+	*capacity = cap;
+	return mem;
+}
+
+size_t orbit_alloc_usable_size(struct orbit_allocator *alloc, void *ptr)
+{
+	if (!ptr || !alloc->use_meta)
+		return 0;
+	return *meta_size(alloc, ptr);
+}
+
+/* ===== Allocator scope ===== */
+
+static __thread struct {
+	size_t depth;
+	struct orbit_allocator *stack[ORBIT_SCOPE_MAX];
+} alloc_scope;
+
+/* Every allocator that has ever been pushed, so that frees can find the
+ * owner of a pointer.  Slots are cleared when the allocator is destroyed. */
+#define ORBIT_SCOPE_OWNERS 64
+static struct orbit_allocator *scope_owners[ORBIT_SCOPE_OWNERS];
+
+static int scope_remember(struct orbit_allocator *alloc)
+{
+	struct orbit_allocator *expected;
+	size_t i;
+
+	for (i = 0; i < ORBIT_SCOPE_OWNERS; ++i) {
+		if (__atomic_load_n(&scope_owners[i], __ATOMIC_ACQUIRE) == alloc)
+			return 0;
+	}
+	for (i = 0; i < ORBIT_SCOPE_OWNERS; ++i) {
+		expected = NULL;
+		if (__atomic_compare_exchange_n(&scope_owners[i], &expected,
+				alloc, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return 0;
+		if (expected == alloc)
+			return 0;
+	}
+	return -1;
+}
+
+static void scope_forget(struct orbit_allocator *alloc)
+{
+	for (size_t i = 0; i < ORBIT_SCOPE_OWNERS; ++i) {
+		struct orbit_allocator *expected = alloc;
+		__atomic_compare_exchange_n(&scope_owners[i], &expected, NULL,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+}
+
+int orbit_alloc_scope_push(struct orbit_allocator *alloc)
+{
+	if (alloc_scope.depth == ORBIT_SCOPE_MAX)
+		return -1;
+	if (alloc && scope_remember(alloc) != 0)
+		return -1;
+	alloc_scope.stack[alloc_scope.depth++] = alloc;
+	return 0;
+}
+
+int orbit_alloc_scope_pop(void)
+{
+	if (alloc_scope.depth == 0)
+		return -1;
+	--alloc_scope.depth;
+	return 0;
+}
+
+struct orbit_allocator *orbit_alloc_scope_current(void)
+{
+	if (alloc_scope.depth == 0)
+		return NULL;
+	return alloc_scope.stack[alloc_scope.depth - 1];
+}
+
+int orbit_alloc_scope_remember(struct orbit_allocator *alloc)
+{
+	return scope_remember(alloc);
+}
+
+struct orbit_allocator *orbit_alloc_scope_owner(const void *ptr)
+{
+	for (size_t i = 0; i < ORBIT_SCOPE_OWNERS; ++i) {
+		struct orbit_allocator *alloc =
+			__atomic_load_n(&scope_owners[i], __ATOMIC_ACQUIRE);
+		if (alloc == NULL)
+			continue;
+		if (alloc->chain)
+			alloc = chain_member_of(alloc->chain->chain, ptr);
+		if (alloc && orbit_allocated_by(ptr, alloc))
+			return alloc;
+	}
+	return NULL;
+}
+
+/* ===== Pool chain ===== */
+
+static struct orbit_chain_member *chain_add(struct orbit_pool_chain *chain,
+		size_t size)
+{
+	struct orbit_chain_member *member;
+	struct orbit_allocator *head;
+
+	if (chain->npool == ORBIT_CHAIN_MAX)
+		return NULL;
+	member = &chain->members[chain->npool];
+
+	member->pool = orbit_pool_create(chain->ob, size);
+	if (member->pool == NULL)
+		return NULL;
+	member->alloc = orbit_allocator_from_pool(member->pool, chain->use_meta);
+	if (member->alloc == NULL)
+		goto alloc_fail;
+
+	/* Members behave like the head allocator */
+	if (chain->npool > 0) {
+		head = chain->members[0].alloc;
+		member->alloc->lockfree = head->lockfree;
+		member->alloc->tcache_size = head->tcache_size;
+		if (head->meta_table &&
+		    orbit_allocator_set_meta_ool(member->alloc) != 0)
+			goto meta_fail;
+	}
+
+	member->alloc->chain = member;
+	member->chain = chain;
+	member->dirty = true;
+	/* Publish the member after it is fully set up */
+	__atomic_store_n(&chain->npool, chain->npool + 1, __ATOMIC_RELEASE);
+
+	return member;
+
+meta_fail:
+	orbit_allocator_destroy(member->alloc);
+alloc_fail:
+	munmap(member->pool->rawptr, member->pool->length);
+	free(member->pool);
+	member->alloc = NULL;
+	member->pool = NULL;
+	return NULL;
+}
+
+/* Find the member allocator `ptr` was allocated from */
+static struct orbit_allocator *chain_member_of(struct orbit_pool_chain *chain,
+		const void *ptr)
+{
+	size_t npool = __atomic_load_n(&chain->npool, __ATOMIC_ACQUIRE);
+
+	for (size_t i = 0; i < npool; ++i) {
+		if (orbit_allocated_by(ptr, chain->members[i].alloc))
+			return chain->members[i].alloc;
+	}
+	return NULL;
+}
+
+struct orbit_pool_chain *orbit_pool_chain_create(struct orbit_module *ob,
+		size_t pool_size, bool use_meta)
+{
+	struct orbit_pool_chain *chain;
+
+	chain = (struct orbit_pool_chain*)calloc(1, sizeof(*chain));
+	if (chain == NULL)
+		return NULL;
+
+	if (pthread_spin_init(&chain->lock, PTHREAD_PROCESS_PRIVATE) != 0)
+		goto lock_init_fail;
+
+	chain->ob = ob;
+	chain->pool_size = pool_size;
+	chain->use_meta = use_meta;
+	chain->cur = 0;
+
+	if (chain_add(chain, pool_size) == NULL)
+		goto add_fail;
+
+	return chain;
+
+add_fail:
+	pthread_spin_destroy(&chain->lock);
+lock_init_fail:
+	free(chain);
+	return NULL;
+}
+
+struct orbit_allocator *orbit_pool_chain_allocator(struct orbit_pool_chain *chain)
+{
+	return chain->members[0].alloc;
+}
+
+static struct orbit_allocator *chain_current(struct orbit_pool_chain *chain)
+{
+	return chain->members[__atomic_load_n(&chain->cur, __ATOMIC_ACQUIRE)].alloc;
+}
+
+/* Called when `full` cannot fit `need` bytes.  Returns the member to retry
+ * on, creating a new pool if `full` is the last one. */
+static struct orbit_allocator *chain_spill(struct orbit_pool_chain *chain,
+		struct orbit_allocator *full, size_t need)
+{
+	struct orbit_allocator *next = NULL;
+	size_t cur;
+
+	if (pthread_spin_lock(&chain->lock) != 0)
+		return NULL;
+
+	cur = chain->cur;
+	if (chain->members[cur].alloc != full) {
+		/* Another thread has already moved on */
+		next = chain->members[cur].alloc;
+		goto out;
+	}
+
+	if (cur + 1 == chain->npool) {
+		size_t size = chain->pool_size;
+		/* Leave room for header and alignment of big objects */
+		if (need + ORBIT_CACHELINE > size)
+			size = round_up_page(need + ORBIT_CACHELINE);
+		if (chain_add(chain, size) == NULL)
+			goto out;
+	}
+
+	__atomic_store_n(&chain->cur, cur + 1, __ATOMIC_RELEASE);
+	next = chain->members[cur + 1].alloc;
+out:
+	pthread_spin_unlock(&chain->lock);
+	return next;
+}
+
+void orbit_pool_chain_touch(struct orbit_pool_chain *chain, void *ptr)
+{
+	size_t npool = __atomic_load_n(&chain->npool, __ATOMIC_ACQUIRE);
+
+	for (size_t i = 0; i < npool; ++i) {
+		struct orbit_chain_member *member = &chain->members[i];
+		if (orbit_allocated_by(ptr, member->alloc)) {
+			__atomic_store_n(&member->dirty, true, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+}
+
+/* Collect members written since the last call and clear their dirty flags.
+ * Returns the number of pools stored in `pools`. */
+static size_t chain_collect(struct orbit_pool_chain *chain,
+		struct orbit_pool **pools)
+{
+	size_t npool = __atomic_load_n(&chain->npool, __ATOMIC_ACQUIRE);
+	size_t n = 0;
+
+	for (size_t i = 0; i < npool; ++i) {
+		struct orbit_chain_member *member = &chain->members[i];
+		if (__atomic_exchange_n(&member->dirty, false, __ATOMIC_ACQ_REL))
+			pools[n++] = member->pool;
+	}
+
+	return n;
+}
+
+long orbit_call_chain(struct orbit_module *module,
+		struct orbit_pool_chain *chain,
+		orbit_entry func, void *arg, size_t argsize)
+{
+	struct orbit_pool *pools[ORBIT_CHAIN_MAX];
+	size_t npool = chain_collect(chain, pools);
+
+	return orbit_call_inner(module, 0, npool, pools, func, arg, argsize);
+}
+
+int orbit_call_chain_async(struct orbit_module *module, unsigned long flags,
+		struct orbit_pool_chain *chain,
+		orbit_entry func, void *arg, size_t argsize, struct orbit_task *task)
+{
+	struct orbit_pool *pools[ORBIT_CHAIN_MAX];
+	size_t npool = chain_collect(chain, pools);
+
+	return orbit_call_async(module, flags, npool, pools, func, arg,
+				argsize, task);
+}
+
+
+/* ===== Scratch ADT ===== */
+
+static int scratch_ctx_init(struct orbit_scratch_ctx *ctx,
+		struct orbit_module *ob, struct orbit_pool *pool)
+{
+	if (!pool || pool->length - pool->used < 2 * 4096)
+		return -1;
+	if (pthread_spin_init(&ctx->lock, PTHREAD_PROCESS_PRIVATE) != 0)
+		return -1;
+
+	memset(&ctx->ring, 0, sizeof(ctx->ring));
+	ctx->ob = ob;
+	ctx->cur = 0;
+	ctx->seq = 0;
+	ctx->ctl = (struct scratch_ctl*)((char*)pool->rawptr + pool->used);
+	ctx->ring[0].pool = pool;
+	ctx->ring[0].base = pool->used + 4096;
+	pool->used = ctx->ring[0].base;
+	return 0;
+}
+
+/* Set global pool used to create orbit_scratch. */
+int orbit_scratch_set_pool(struct orbit_pool *pool)
+{
+	return scratch_ctx_init(&info.scratch, NULL, pool);
+}
+
+struct orbit_scratch_ctx *orbit_scratch_ctx_create(struct orbit_module *ob,
+		struct orbit_pool *pool)
+{
+	struct orbit_scratch_ctx *ctx;
+
+	ctx = (struct orbit_scratch_ctx*)malloc(sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+	if (scratch_ctx_init(ctx, ob, pool) != 0) {
+		free(ctx);
+		return NULL;
+	}
+	if (ob)
+		ob->scratch_ctx = ctx;
+	return ctx;
+}
+
+void orbit_scratch_ctx_destroy(struct orbit_scratch_ctx *ctx)
+{
+	/* Pools of the ring other than the user's were created by us */
+	for (size_t i = 1; i < ORBIT_SCRATCH_RING; ++i) {
+		struct orbit_pool *pool = ctx->ring[i].pool;
+		if (pool) {
+			munmap(pool->rawptr, pool->length);
+			free(pool);
+		}
+	}
+	if (ctx->ob && ctx->ob->scratch_ctx == ctx)
+		ctx->ob->scratch_ctx = NULL;
+	pthread_spin_destroy(&ctx->lock);
+	free(ctx);
+}
+
+/* Scratches of the orbit the context sends from that the main program has
+ * finished, as of the last orbit_call */
+static unsigned long scratch_finished(struct orbit_scratch_ctx *ctx)
+{
+	struct scratch_ctl_entry *e;
+
+	e = ctl_entry(ctx->ctl, ctx->ob ? ctx->ob : orbit_self, false);
+	return e ? __atomic_load_n(&e->finished, __ATOMIC_ACQUIRE) : 0;
+}
+
+/* Move on to the next pool in the ring.  A pool is reused once all
+ * scratches created in it are sent or discarded, and the main program has
+ * finished all scratches sent from it.
+ * The caller must hold the context lock. */
+static int scratch_advance(struct orbit_scratch_ctx *ctx)
+{
+	struct orbit_pool *first = ctx->ring[0].pool;
+
+	for (size_t i = 1; i <= ORBIT_SCRATCH_RING; ++i) {
+		size_t idx = (ctx->cur + i) % ORBIT_SCRATCH_RING;
+		struct scratch_slot *slot = &ctx->ring[idx];
+
+		if (slot->pool == NULL) {
+			slot->pool = orbit_pool_create(ctx->ob, first->length);
+			if (slot->pool == NULL)
+				return -1;
+			slot->pool->mode = first->mode;
+			slot->base = 0;
+		} else if (__atomic_load_n(&slot->pending, __ATOMIC_ACQUIRE) ||
+			   __atomic_load_n(&slot->last_seq, __ATOMIC_ACQUIRE) >
+			   scratch_finished(ctx)) {
+			/* Still in use; later pools were filled even later. */
+			return -1;
+		} else {
+			madvise((char*)slot->pool->rawptr + slot->base,
+				slot->pool->used - slot->base, MADV_DONTNEED);
+			__atomic_store_n(&slot->pool->used, slot->base,
+					 __ATOMIC_RELEASE);
+		}
+
+		__atomic_store_n(&ctx->cur, idx, __ATOMIC_RELEASE);
+		return 0;
+	}
+	return -1;
+}
+
+/* Reserve `size` bytes (the rest of the current pool if 0) for a scratch.
+ * Threads reserve with a CAS on the pool's `used`, and only take the lock
+ * to move along the ring. */
+static int scratch_reserve(struct orbit_scratch_ctx *ctx,
+		struct orbit_scratch *s, size_t size)
+{
+	size = round_up_page(size);
+
+	for (;;) {
+		size_t cur = __atomic_load_n(&ctx->cur, __ATOMIC_ACQUIRE);
+		struct scratch_slot *slot = &ctx->ring[cur];
+		struct orbit_pool *pool = slot->pool;
+		size_t used, want;
+		int ret = 0;
+
+		if (pool == NULL)
+			return -1;
+		if (size > pool->length - slot->base)
+			return -1;	/* Never fits */
+
+		used = __atomic_load_n(&pool->used, __ATOMIC_ACQUIRE);
+		want = size ? size : pool->length - used;
+		if (want != 0 && want <= pool->length - used) {
+			if (!__atomic_compare_exchange_n(&pool->used, &used,
+					used + want, false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE))
+				continue;
+			__atomic_add_fetch(&slot->pending, 1, __ATOMIC_ACQ_REL);
+			s->ptr = (char*)pool->rawptr + used;
+			s->size_limit = want;
+			return 0;
+		}
+
+		pthread_spin_lock(&ctx->lock);
+		if (__atomic_load_n(&ctx->cur, __ATOMIC_ACQUIRE) == cur)
+			ret = scratch_advance(ctx);
+		pthread_spin_unlock(&ctx->lock);
+		if (ret != 0)
+			return ret;
+	}
+}
+
+int orbit_scratch_create_in(struct orbit_scratch_ctx *ctx,
+		struct orbit_scratch *s, size_t size)
+{
+	if (scratch_reserve(ctx, s, size) != 0)
+		return -1;
+
+	s->cursor = 0;
+	s->count = 0;
+	s->any_alloc = NULL;
+	s->ctx = ctx;
+	s->flags = 0;
+	s->flush_threshold = 0;
+	s->tail = 0;
+	s->sub = 0;
+	s->sub_addr = NULL;
+
+	return 0;
+}
+
+int orbit_scratch_create(struct orbit_scratch *s)
+{
+	return orbit_scratch_create_in(&info.scratch, s, 0);
+}
+
+int orbit_scratch_set_autoflush(struct orbit_scratch *s, size_t threshold)
+{
+	if (threshold && s->ctx == NULL)
+		return -1;	/* Nowhere to get the next segment from */
+	s->flush_threshold = threshold;
+	return 0;
+}
+
+int orbit_scratch_flush(struct orbit_scratch *s)
+{
+	struct orbit_scratch_ctx *ctx = s->ctx;
+	unsigned long flags = s->flags;
+	size_t threshold = s->flush_threshold;
+	size_t size = s->size_limit;
+	int ret;
+
+	if (ctx == NULL)
+		return -1;
+	if (s->count == 0 && s->any_alloc == NULL)
+		return 0;
+
+	ret = orbit_sendv(s);
+	if (ret < 0)
+		return ret;
+
+	/* Continue in a new segment, no larger than the last one, and with
+	 * autoflush, just large enough for a threshold and some more. */
+	if (threshold && round_up_page(2 * threshold) < size)
+		size = round_up_page(2 * threshold);
+	if (orbit_scratch_create_in(ctx, s, size) != 0) {
+		/* The sent space must not be written any more. */
+		s->cursor = s->size_limit = s->count = 0;
+		return -1;
+	}
+	s->flags = flags;
+	s->flush_threshold = threshold;
+	return 0;
+}
+
+/* With autoflush, send what we have if the next record does not fit. */
+static void scratch_make_room(struct orbit_scratch *s, size_t rec_size)
+{
+	if (s->flush_threshold && s->count &&
+	    rec_size > s->size_limit - s->cursor)
+		orbit_scratch_flush(s);
+}
+
+/* Count a pushed record, and with autoflush, send the segment once it
+ * reaches the threshold.  If sending fails, the record stays and is sent
+ * with the next segment. */
+static int scratch_pushed(struct orbit_scratch *s)
+{
+	int count = ++s->count;
+
+	if (s->flush_threshold && s->cursor >= s->flush_threshold)
+		orbit_scratch_flush(s);
+	return count;
+}
+
+struct orbit_allocator *orbit_scratch_open_any(struct orbit_scratch *s, bool use_meta)
+{
+	struct orbit_repr *record;
+	size_t rec_size = sizeof(struct orbit_repr);
+
+	orbit_scratch_close_any(s);
+	scratch_make_room(s, rec_size);
+
+	if (rec_size > s->size_limit - s->cursor)
+		return NULL;
+
+	record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+	record->type = ORBIT_ANY;
+	record->any.length = 0;  /* Unknown size, filled by `conclude' */
+
+	s->any_alloc = orbit_allocator_create(
+			record->any.data,
+			s->size_limit - (record->any.data - (char*)s->ptr),
+			&record->any.length,
+			use_meta);
+
+	return s->any_alloc;
+}
+
+int orbit_scratch_close_any(struct orbit_scratch *s)
+{
+	struct orbit_repr *record;
+
+	if (!s->any_alloc)
+		return s->count;
+
+	record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+
+	s->cursor += sizeof(struct orbit_repr) + record->any.length;
+	s->cursor = round_up_record(s->cursor);
+
+	orbit_allocator_destroy(s->any_alloc);
+	s->any_alloc = NULL;
+
+	return ++s->count;
+}
+
+static size_t varint_put(char *p, unsigned long value)
+{
+	size_t n = 0;
+
+	while (value >= 0x80) {
+		p[n++] = (char)(value | 0x80);
+		value >>= 7;
+	}
+	p[n++] = (char)value;
+	return n;
+}
+
+static size_t varint_get(const char *p, unsigned long *value)
+{
+	size_t n = 0;
+	unsigned int shift = 0;
+
+	*value = 0;
+	do {
+		*value |= (unsigned long)(p[n] & 0x7f) << shift;
+		shift += 7;
+	} while (p[n++] & 0x80);
+	return n;
+}
+
+/* Tag byte, address and length varints */
+#define PACKED_HDR_MAX (1 + 10 + 10)
+
+static ssize_t repr_extra_size(const struct orbit_repr *record);
+
+/* Get the record being pushed to if it is of `type` and still the last one
+ * of the scratch */
+static struct orbit_repr *scratch_open_tail(struct orbit_scratch *s,
+		enum orbit_type type)
+{
+	struct orbit_repr *record;
+
+	if (s->tail == 0)
+		return NULL;
+	record = (struct orbit_repr*)((char*)s->ptr + s->tail - 1);
+	if (record->type != type ||
+	    round_up_record(s->tail - 1 + sizeof(struct orbit_repr) +
+			    repr_extra_size(record)) != s->cursor)
+		return NULL;
+	return record;
+}
+
+/* Append the header of an update of `length` bytes at `ptr` to a packed
+ * record, `*last` being the end of the update before it.  Returns where
+ * its data goes. */
+static char *packed_put(struct orbit_packed *packed, char **last, void *ptr,
+		size_t length)
+{
+	char *start = packed->data + packed->size, *p = start;
+	long delta = (long)((uintptr_t)ptr - (uintptr_t)*last);
+
+	if (length < 15) {
+		*p++ = (char)((ORBIT_UPDATE << 4) | length);
+	} else {
+		*p++ = (char)((ORBIT_UPDATE << 4) | 15);
+		p += varint_put(p, length);
+	}
+	p += varint_put(p, ((unsigned long)delta << 1) ^ (delta >> 63));
+
+	packed->size += (size_t)(p - start) + length;
+	packed->count++;
+	*last = (char*)ptr + length;
+	return p;
+}
+
+static int scratch_push_packed(struct orbit_scratch *s, void *ptr,
+		size_t length)
+{
+	struct orbit_repr *record;
+	size_t need = PACKED_HDR_MAX + length;
+	char *last;
+
+	orbit_scratch_close_any(s);
+
+	record = scratch_open_tail(s, ORBIT_PACKED);
+	if (record == NULL || need > s->size_limit - s->cursor) {
+		/* Start a new packed record */
+		need += sizeof(struct orbit_repr);
+		scratch_make_room(s, need);
+		if (need > s->size_limit - s->cursor)
+			return -1;	/* No enough space */
+
+		record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+		record->type = ORBIT_PACKED;
+		s->packed_last = NULL;
+		record->packed.size = 0;
+		record->packed.count = 0;
+		s->tail = s->cursor + 1;
+		++s->count;
+	}
+
+	last = (char*)s->packed_last;
+	memcpy(packed_put(&record->packed, &last, ptr, length), ptr, length);
+	s->packed_last = last;
+	s->cursor = round_up_record(s->tail - 1 + sizeof(struct orbit_repr) +
+			record->packed.size);
+
+	/* The record was counted when started */
+	--s->count;
+	return scratch_pushed(s);
+}
+
+int orbit_scratch_push_update(struct orbit_scratch *s, void *ptr, size_t length)
+{
+	struct orbit_repr *record;
+	size_t rec_size = sizeof(struct orbit_repr) + length;
+
+	if ((s->flags & ORBIT_SCRATCH_PACKED) && length <= ORBIT_PACKED_MAX)
+		return scratch_push_packed(s, ptr, length);
+
+	orbit_scratch_close_any(s);
+	scratch_make_room(s, rec_size);
+
+	if (rec_size > s->size_limit - s->cursor)
+		return -1;	/* No enough space */
+
+	record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+
+	record->type = ORBIT_UPDATE;
+	record->update.ptr = ptr;
+	record->update.length = length;
+	memcpy(record->update.data, ptr, length);
+
+	s->cursor += rec_size;
+	s->cursor = round_up_record(s->cursor);
+
+	return scratch_pushed(s);
+}
+
+static int scratch_push_store(struct orbit_scratch *s, enum orbit_type type,
+		void *ptr, uint64_t value)
+{
+	struct orbit_repr *record;
+	size_t rec_size = sizeof(struct orbit_repr);
+
+	orbit_scratch_close_any(s);
+	scratch_make_room(s, rec_size);
+
+	if (rec_size > s->size_limit - s->cursor)
+		return -1;	/* No enough space */
+
+	record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+
+	record->type = type;
+	record->store.ptr = ptr;
+	record->store.value = value;
+
+	s->cursor += rec_size;
+	s->cursor = round_up_record(s->cursor);
+
+	return scratch_pushed(s);
+}
+
+int orbit_scratch_push_u8(struct orbit_scratch *s, uint8_t *ptr, uint8_t value)
+{
+	return scratch_push_store(s, ORBIT_STORE8, ptr, value);
+}
+
+int orbit_scratch_push_u16(struct orbit_scratch *s, uint16_t *ptr, uint16_t value)
+{
+	return scratch_push_store(s, ORBIT_STORE16, ptr, value);
+}
+
+int orbit_scratch_push_u32(struct orbit_scratch *s, uint32_t *ptr, uint32_t value)
+{
+	return scratch_push_store(s, ORBIT_STORE32, ptr, value);
+}
+
+int orbit_scratch_push_u64(struct orbit_scratch *s, uint64_t *ptr, uint64_t value)
+{
+	return scratch_push_store(s, ORBIT_STORE64, ptr, value);
+}
+
+void *orbit_scratch_push_any(struct orbit_scratch *s, void *ptr, size_t length)
+{
+	struct orbit_repr *record;
+	size_t rec_size = sizeof(struct orbit_repr) + length;
+
+	orbit_scratch_close_any(s);
+	scratch_make_room(s, rec_size);
+
+	if (rec_size > s->size_limit - s->cursor)
+		return NULL;	/* No enough space */
+
+	record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+
+	record->type = ORBIT_ANY;
+	record->any.length = length;
+	// Act as preallocating fixed area
+	if (ptr) memcpy(record->any.data, ptr, length);
+
+	s->cursor += rec_size;
+	s->cursor = round_up_record(s->cursor);
+	++s->count;
+
+	return record->any.data;
+}
+
+int orbit_scratch_push_operation(struct orbit_scratch *s,
+		orbit_operation_func func, size_t argc, unsigned long argv[])
+{
+	struct orbit_repr *record;
+	size_t length = argc * sizeof(*argv);
+	size_t rec_size = sizeof(struct orbit_repr) + length;
+
+	orbit_scratch_close_any(s);
+	scratch_make_room(s, rec_size);
+
+	if (rec_size > s->size_limit - s->cursor)
+		return -1;	/* No enough space */
+
+	record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+
+	record->type = ORBIT_OPERATION;
+	record->operation.func = func;
+	record->operation.argc = argc;
+	memcpy(record->operation.argv, argv, length);
+
+	s->cursor += rec_size;
+	s->cursor = round_up_record(s->cursor);
+
+	return scratch_pushed(s);
+}
+
+int orbit_scratch_push_batch(struct orbit_scratch *s,
+		orbit_batch_func func, size_t argc, unsigned long argv[])
+{
+	struct orbit_repr *record;
+	size_t length = argc * sizeof(*argv);
+
+	orbit_scratch_close_any(s);
+
+	record = scratch_open_tail(s, ORBIT_BATCH);
+	if (record == NULL || record->batch.func != func ||
+	    record->batch.argc != argc || record->batch.count == UINT_MAX ||
+	    length > s->size_limit - s->cursor) {
+		/* Start a new batch record */
+		size_t rec_size = sizeof(struct orbit_repr) + length;
+
+		if (argc > UINT_MAX)
+			return -1;
+		scratch_make_room(s, rec_size);
+		if (rec_size > s->size_limit - s->cursor)
+			return -1;	/* No enough space */
+
+		record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+		record->type = ORBIT_BATCH;
+		record->batch.func = func;
+		record->batch.argc = argc;
+		record->batch.count = 0;
+		s->tail = s->cursor + 1;
+		++s->count;
+	}
+
+	memcpy(record->batch.argv + (size_t)record->batch.count * argc,
+		argv, length);
+	record->batch.count++;
+	s->cursor = round_up_record(s->tail - 1 + sizeof(struct orbit_repr) +
+			repr_extra_size(record));
+
+	/* The record was counted when started */
+	--s->count;
+	return scratch_pushed(s);
+}
+
+/* Encode the bytes of `cur` that differ from `orig` as runs.  Returns the
+ * encoded size, or -1 if it would exceed `limit`. */
+static ssize_t delta_encode(char *out, size_t limit, const char *cur,
+		const char *orig, size_t length)
+{
+	const size_t hdr = sizeof(struct orbit_delta_run);
+	size_t i = 0, pos = 0;
+
+	while (i < length) {
+		struct orbit_delta_run run;
+		size_t start, end;
+
+		while (i + sizeof(long) <= length &&
+		       memcmp(cur + i, orig + i, sizeof(long)) == 0)
+			i += sizeof(long);
+		while (i < length && cur[i] == orig[i])
+			++i;
+		if (i == length)
+			break;
+
+		/* Equal gaps shorter than a run header stay in the run. */
+		start = end = i;
+		while (i < length) {
+			if (cur[i] != orig[i])
+				end = ++i;
+			else if (++i - end >= hdr)
+				break;
+		}
+
+		if (round_up_4(pos + hdr + (end - start)) > limit)
+			return -1;
+		run.offset = start;
+		run.length = end - start;
+		memcpy(out + pos, &run, hdr);
+		memcpy(out + pos + hdr, cur + start, run.length);
+		pos = round_up_4(pos + hdr + run.length);
+	}
+	return pos;
+}
+
+int orbit_scratch_push_delta(struct orbit_scratch *s, void *ptr,
+		const void *orig, size_t length)
+{
+	struct orbit_repr *record;
+	size_t avail, limit;
+	ssize_t size;
+
+	orbit_scratch_close_any(s);
+	/* The delta is never larger than the update it falls back to */
+	scratch_make_room(s, round_up_record(sizeof(struct orbit_repr) +
+				length));
+
+	if (sizeof(struct orbit_repr) > s->size_limit - s->cursor)
+		return -1;	/* No enough space */
+	if (length > UINT_MAX)
+		return orbit_scratch_push_update(s, ptr, length);
+
+	record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+	avail = s->size_limit - s->cursor - sizeof(struct orbit_repr);
+	limit = avail < length ? avail : length;
+
+	size = delta_encode(record->delta.data, limit, (const char*)ptr,
+			(const char*)orig, length);
+	if (size < 0)
+		return orbit_scratch_push_update(s, ptr, length);
+
+	record->type = ORBIT_DELTA;
+	record->delta.ptr = ptr;
+	record->delta.length = length;
+	record->delta.size = size;
+
+	s->cursor += sizeof(struct orbit_repr) + size;
+	s->cursor = round_up_record(s->cursor);
+
+	return scratch_pushed(s);
+}
+
+/* Updates at least this large are copied with non-temporal stores, so that
+ * applying them does not evict the rest of the main program's cache. */
+#define APPLY_STREAM_MIN (256 * 1024)
+
+#ifdef __SSE2__
+static void stream_copy(char *dst, const char *src, size_t n)
+{
+	size_t head = -(uintptr_t)dst & 15;
+
+	memcpy(dst, src, head);
+	dst += head, src += head, n -= head;
+	for (; n >= 64; n -= 64, dst += 64, src += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i*)src);
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+		_mm_stream_si128((__m128i*)dst, a);
+		_mm_stream_si128((__m128i*)(dst + 16), b);
+		_mm_stream_si128((__m128i*)(dst + 32), c);
+		_mm_stream_si128((__m128i*)(dst + 48), d);
+	}
+	_mm_sfence();
+	memcpy(dst, src, n);
+}
+#endif
+
+/* Copy the data of an update into place, picked by size.  Up to 16 bytes
+ * takes two possibly overlapping loads and stores instead of a call. */
+static inline void apply_copy(void *_dst, const void *_src, size_t n)
+{
+	char *dst = (char*)_dst;
+	const char *src = (const char*)_src;
+
+	if (n <= 16) {
+		if (n >= 8) {
+			uint64_t a, b;
+			memcpy(&a, src, 8);
+			memcpy(&b, src + n - 8, 8);
+			memcpy(dst, &a, 8);
+			memcpy(dst + n - 8, &b, 8);
+		} else if (n >= 4) {
+			uint32_t a, b;
+			memcpy(&a, src, 4);
+			memcpy(&b, src + n - 4, 4);
+			memcpy(dst, &a, 4);
+			memcpy(dst + n - 4, &b, 4);
+		} else if (n >= 2) {
+			uint16_t a, b;
+			memcpy(&a, src, 2);
+			memcpy(&b, src + n - 2, 2);
+			memcpy(dst, &a, 2);
+			memcpy(dst + n - 2, &b, 2);
+		} else if (n == 1) {
+			*dst = *src;
+		}
+		return;
+	}
+#ifdef __SSE2__
+	if (n >= APPLY_STREAM_MIN) {
+		stream_copy(dst, src, n);
+		return;
+	}
+#endif
+	memcpy(dst, src, n);
+}
+
+/* Copy the runs of a delta record to its range */
+static void delta_apply(const struct orbit_delta *delta)
+{
+	const size_t hdr = sizeof(struct orbit_delta_run);
+	size_t pos = 0;
+
+	while (pos < delta->size) {
+		struct orbit_delta_run run;
+
+		memcpy(&run, delta->data + pos, hdr);
+		apply_copy((char*)delta->ptr + run.offset,
+			delta->data + pos + hdr, run.length);
+		pos = round_up_4(pos + hdr + run.length);
+	}
+}
+
+/* Decode one update of a packed record at `p`, with `*addr` the end of the
+ * previous one.  Returns the encoded size. */
+static size_t packed_get(const char *p, char **addr, size_t *length,
+		const char **data)
+{
+	const char *start = p;
+	unsigned long value;
+
+	*length = *p++ & 15;
+	if (*length == 15) {
+		p += varint_get(p, &value);
+		*length = value;
+	}
+	p += varint_get(p, &value);
+	*addr = (char*)((uintptr_t)*addr +
+			((value >> 1) ^ -(unsigned long)(value & 1)));
+	*data = p;
+	return p + *length - start;
+}
+
+static void packed_apply(const struct orbit_packed *packed)
+{
+	char *addr = NULL;
+
+	for (size_t pos = 0; pos < packed->size; ) {
+		size_t length;
+		const char *data;
+
+		pos += packed_get(packed->data + pos, &addr, &length, &data);
+		apply_copy(addr, data, length);
+		addr += length;
+	}
+}
+
+static inline bool is_store(enum orbit_type type)
+{
+	return type >= ORBIT_STORE8 && type <= ORBIT_STORE64;
+}
+
+/* Size of the value of an ORBIT_STORE* record */
+static inline size_t store_width(enum orbit_type type)
+{
+	return (size_t)1 << (type - ORBIT_STORE8);
+}
+
+static inline void store_apply(enum orbit_type type,
+		const struct orbit_store *store)
+{
+	switch (type) {
+	case ORBIT_STORE8:
+		*(uint8_t*)store->ptr = store->value;
+		break;
+	case ORBIT_STORE16:
+		*(uint16_t*)store->ptr = store->value;
+		break;
+	case ORBIT_STORE32:
+		*(uint32_t*)store->ptr = store->value;
+		break;
+	default:
+		*(uint64_t*)store->ptr = store->value;
+		break;
+	}
+}
+
+/* Size of the data following a record's header, or -1 if unknown */
+static ssize_t repr_extra_size(const struct orbit_repr *record)
+{
+	switch (record->type) {
+	case ORBIT_UPDATE:
+		return record->update.length;
+	case ORBIT_OPERATION:
+		return record->operation.argc * sizeof(*record->operation.argv);
+	case ORBIT_ANY:
+		return record->any.length;
+	case ORBIT_DELTA:
+		return record->delta.size;
+	case ORBIT_PACKED:
+		return record->packed.size;
+	case ORBIT_BATCH:
+		return (size_t)record->batch.count * record->batch.argc *
+			sizeof(*record->batch.argv);
+	case ORBIT_STORE8:
+	case ORBIT_STORE16:
+	case ORBIT_STORE32:
+	case ORBIT_STORE64:
+	case ORBIT_END:
+		return 0;
+	case ORBIT_UNKNOWN:
+	default:
+		return -1;
+	}
+}
+
+struct compact_ent {
+	char *start, *end;
+	const char *data;
+	char *out;		/* Where its data goes in the merged record */
+};
+
+static int compact_ent_cmp(const void *a, const void *b)
+{
+	const struct compact_ent *x = *(const struct compact_ent * const *)a;
+	const struct compact_ent *y = *(const struct compact_ent * const *)b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Write the `n` updates in `ents` to `out` at `*cursor` as one record per
+ * run of overlapping or adjacent ranges, or with `packed`, as one packed
+ * update for runs of up to ORBIT_PACKED_MAX bytes.  Updates are copied in
+ * their original order, so the last write to a byte wins.
+ * Returns the number of records written. */
+static size_t compact_updates(struct compact_ent *ents,
+		struct compact_ent **order, size_t n, bool packed,
+		char *out, size_t *cursor)
+{
+	struct orbit_repr *tail = NULL;	/* Packed record being written */
+	char *last = NULL;		/* End of its last update */
+	size_t nrec = 0;
+
+	for (size_t i = 0; i < n; ++i)
+		order[i] = &ents[i];
+	qsort(order, n, sizeof(*order), compact_ent_cmp);
+
+	for (size_t i = 0, j; i < n; i = j) {
+		char *start = order[i]->start, *end = order[i]->end, *dst;
+
+		for (j = i + 1; j < n && order[j]->start <= end; ++j)
+			if (order[j]->end > end)
+				end = order[j]->end;
+
+		if (packed && (size_t)(end - start) <= ORBIT_PACKED_MAX) {
+			if (tail == NULL) {
+				tail = (struct orbit_repr*)(out + *cursor);
+				tail->type = ORBIT_PACKED;
+				last = NULL;
+				tail->packed.size = 0;
+				tail->packed.count = 0;
+				++nrec;
+			}
+			dst = packed_put(&tail->packed, &last, start,
+					end - start);
+		} else {
+			struct orbit_repr *rec;
+
+			if (tail)
+				*cursor = round_up_record(*cursor +
+					sizeof(struct orbit_repr) +
+					tail->packed.size);
+			tail = NULL;
+			rec = (struct orbit_repr*)(out + *cursor);
+			rec->type = ORBIT_UPDATE;
+			rec->update.ptr = start;
+			rec->update.length = end - start;
+			dst = rec->update.data;
+			*cursor = round_up_record(*cursor +
+					sizeof(struct orbit_repr) + (end - start));
+			++nrec;
+		}
+		for (size_t k = i; k < j; ++k)
+			order[k]->out = dst + (order[k]->start - start);
+	}
+	if (tail)
+		*cursor = round_up_record(*cursor + sizeof(struct orbit_repr) +
+				tail->packed.size);
+
+	for (size_t i = 0; i < n; ++i)
+		memcpy(ents[i].out, ents[i].data, ents[i].end - ents[i].start);
+	return nrec;
+}
+
+int orbit_scratch_compact(struct orbit_scratch *s)
+{
+	struct compact_ent *ents, **order;
+	size_t in = 0, out_cursor = 0, n = 0, count = 0, nsub = 0;
+	size_t keep = 0, nkeep = 0;
+	bool packed = s->flags & ORBIT_SCRATCH_PACKED;
+	char *out;
+	int ret = -1;
+
+	orbit_scratch_close_any(s);
+	if (s->count == 0)
+		return 0;
+
+	/* Updates in packed records are merged along with the others.
+	 * Objects may point into ORBIT_ANY records, so nothing up to the
+	 * last of them is moved. */
+	for (size_t i = 0; i < s->count; ++i) {
+		struct orbit_repr *record =
+			(struct orbit_repr*)((char*)s->ptr + in);
+		ssize_t extra = repr_extra_size(record);
+
+		if (extra < 0)
+			return -1;
+		in = round_up_record(in + sizeof(struct orbit_repr) + extra);
+		if (record->type == ORBIT_PACKED) {
+			nsub += record->packed.count;
+		} else if (record->type == ORBIT_ANY) {
+			keep = in;
+			nkeep = i + 1;
+			nsub = 0;
+		}
+	}
+	in = keep;
+
+	ents = (struct compact_ent*)malloc((s->count + nsub) * sizeof(*ents));
+	order = (struct compact_ent**)malloc((s->count + nsub) *
+			sizeof(*order));
+	/* Merged records take no more space than the originals, but each
+	 * record or packed update may end up with a header of its own. */
+	out = (char*)malloc(s->cursor - keep + (s->count - nkeep + nsub) *
+			(sizeof(struct orbit_repr) + ORBIT_RECORD_ALIGN));
+	if (!ents || !order || !out) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	for (size_t i = nkeep; i < s->count; ++i) {
+		struct orbit_repr *record =
+			(struct orbit_repr*)((char*)s->ptr + in);
+		ssize_t extra = repr_extra_size(record);
+		size_t rec_size = sizeof(struct orbit_repr) + extra;
+
+		if (extra < 0)
+			goto out;
+
+		if (record->type == ORBIT_UPDATE) {
+			char *ptr = (char*)record->update.ptr;
+			if (extra > 0)
+				ents[n++] = (struct compact_ent) {
+					.start = ptr,
+					.end = ptr + extra,
+					.data = record->update.data,
+				};
+		} else if (record->type == ORBIT_PACKED) {
+			char *addr = NULL;
+
+			for (size_t pos = 0; pos < record->packed.size; ) {
+				size_t length;
+				const char *data;
+
+				pos += packed_get(record->packed.data + pos,
+						&addr, &length, &data);
+				if (length > 0)
+					ents[n++] = (struct compact_ent) {
+						.start = addr,
+						.end = addr + length,
+						.data = data,
+					};
+				addr += length;
+			}
+		} else {
+			/* Updates must not move across anything else. */
+			count += compact_updates(ents, order, n, packed, out,
+					&out_cursor);
+			n = 0;
+			memcpy(out + out_cursor, record, rec_size);
+			out_cursor = round_up_record(out_cursor + rec_size);
+			++count;
+		}
+		in = round_up_record(in + rec_size);
+	}
+	count += compact_updates(ents, order, n, packed, out, &out_cursor);
+	if (out_cursor > s->size_limit - keep) {
+		errno = ENOSPC;
+		goto out;
+	}
+
+	memcpy((char*)s->ptr + keep, out, out_cursor);
+	s->cursor = keep + out_cursor;
+	count += nkeep;
+	s->count = count;
+	s->tail = 0;
+	ret = count;
+out:
+	free(ents);
+	free(order);
+	free(out);
+	return ret;
+}
+
+/* Find the slot of the ring a scratch was created in */
+static struct scratch_slot *scratch_slot_of(const struct orbit_scratch *s)
+{
+	struct orbit_scratch_ctx *ctx = s->ctx;
+
+	if (ctx == NULL)
+		return NULL;
+	for (size_t i = 0; i < ORBIT_SCRATCH_RING; ++i) {
+		struct orbit_pool *pool = ctx->ring[i].pool;
+		if (pool && (char*)s->ptr >= (char*)pool->rawptr &&
+		    (char*)s->ptr < (char*)pool->rawptr + pool->length)
+			return &ctx->ring[i];
+	}
+	return NULL;
+}
+
+/* Give back the reservation beyond the first `keep` bytes if nobody
+ * reserved after it, and stop holding the pool. */
+static void scratch_release(const struct orbit_scratch *s,
+		struct scratch_slot *slot, size_t keep)
+{
+	struct orbit_pool *pool = slot->pool;
+	size_t start = (char*)s->ptr - (char*)pool->rawptr;
+	size_t end = start + s->size_limit;
+
+	__atomic_compare_exchange_n(&pool->used, &end, start + keep, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&slot->pending, 1, __ATOMIC_ACQ_REL);
+}
+
+int orbit_scratch_discard(struct orbit_scratch *s)
+{
+	struct scratch_slot *slot = scratch_slot_of(s);
+
+	if (slot == NULL)
+		return -1;
+	orbit_scratch_close_any(s);
+	scratch_release(s, slot, 0);
+	s->ctx = NULL;
+	return 0;
+}
+
+/* Done with a scratch whose first `sent` bytes were sent, as sealed */
+static void scratch_trunc(struct orbit_scratch *s, size_t sent)
+{
+	struct orbit_scratch_ctx *ctx = s->ctx;
+	struct scratch_slot *slot = scratch_slot_of(s);
+	unsigned long seq, last;
+
+	if (slot == NULL)
+		return;
+
+	/* The pool is recycled by scratch_advance() after the main program
+	 * calls orbit_recvv_finish() on this scratch. */
+	seq = __atomic_add_fetch(&ctx->seq, 1, __ATOMIC_ACQ_REL);
+	last = __atomic_load_n(&slot->last_seq, __ATOMIC_RELAXED);
+	while (last < seq && !__atomic_compare_exchange_n(&slot->last_seq,
+			&last, seq, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	scratch_release(s, slot, sent);
+	s->ctx = NULL;
+}
+
+static struct orbit_index_footer *index_footer(const struct orbit_scratch *s,
+		size_t size)
+{
+	if (size < sizeof(struct orbit_index_footer))
+		return NULL;
+	return (struct orbit_index_footer*)((char*)s->ptr + size -
+			sizeof(struct orbit_index_footer));
+}
+
+size_t orbit_scratch_seal(struct orbit_scratch *s)
+{
+	struct orbit_index_footer *footer;
+	struct orbit_index_entry *table;
+	size_t table_off, end, size, offset = 0;
+
+	orbit_scratch_close_any(s);
+
+	table_off = round_up_8(s->cursor);
+	end = table_off + s->count * sizeof(*table) + sizeof(*footer);
+
+	if (!(s->flags & ORBIT_SCRATCH_INDEX) || end > s->size_limit ||
+	    end > UINT_MAX) {
+		/* Do not let a previous scratch's index show through. */
+		size = round_up_page(s->cursor);
+		footer = index_footer(s, size);
+		if (footer && (char*)footer >= (char*)s->ptr + s->cursor)
+			footer->magic = 0;
+		return size;
+	}
+
+	table = (struct orbit_index_entry*)((char*)s->ptr + table_off);
+	for (size_t i = 0; i < s->count; ++i) {
+		struct orbit_repr *record =
+			(struct orbit_repr*)((char*)s->ptr + offset);
+		ssize_t extra = repr_extra_size(record);
+
+		table[i].offset = offset;
+		table[i].type = record->type;
+		if (extra < 0)
+			extra = 0;
+		offset = round_up_record(offset + sizeof(struct orbit_repr) + extra);
+	}
+
+	/* The footer goes at the very end of the sent pages. */
+	size = round_up_page(end);
+	footer = index_footer(s, size);
+	footer->magic = ORBIT_INDEX_MAGIC;
+	footer->count = s->count;
+	footer->table = table_off;
+	return size;
+}
+
+int orbit_sendv(struct orbit_scratch *s)
+{
+	int ret;
+	struct orbit_scratch buf;
+
+	buf = (struct orbit_scratch) {
 		.ptr = s->ptr,
 		.cursor = 0,
-		.size_limit = round_up_page(s->cursor),
+		.size_limit = orbit_scratch_seal(s),
 		.count = s->count,
 	};
 
@@ -590,10 +2941,9 @@ int orbit_sendv(struct orbit_scratch *s)
 	if (ret < 0)
 		return ret;
 
-	/* If the send is not successful, we do not call trunc(), and it is
-	 * safe to allocate a new scratch in the same area since we will
-	 * rewrite it later anyway. */
-	scratch_trunc(s);
+	/* If the send is not successful, we do not call trunc().  The caller
+	 * may retry, or orbit_scratch_discard() the scratch. */
+	scratch_trunc(s, buf.size_limit);
 
 	return ret;
 }
@@ -602,8 +2952,17 @@ int orbit_recvv(union orbit_result *result, struct orbit_task *task)
 {
 	int ret = syscall(SYS_ORBIT_RECVV, result, task->orbit->gobid,
 			  task->taskid);
-	if (ret == 1)
+	if (ret == 1) {
 		result->scratch.cursor = 0;
+		result->scratch.any_alloc = NULL;
+		result->scratch.flags = 0;
+		result->scratch.sub = 0;
+		result->scratch.sub_addr = NULL;
+		result->scratch.orbit = task->orbit;
+		/* Where orbit_recvv_finish() acknowledges it */
+		result->scratch.ctx = task->orbit->scratch_ctx ?
+			task->orbit->scratch_ctx : &info.scratch;
+	}
 	return ret;
 }
 
@@ -645,12 +3004,14 @@ enum orbit_type orbit_apply_one(struct orbit_scratch *s, bool yield)
 	enum orbit_type type = record->type;
 	size_t extra_size = 0;
 
-	if (type == ORBIT_UPDATE) {
+	if (is_store(type)) {
+		store_apply(type, &record->store);
+	} else if (type == ORBIT_UPDATE) {
 		struct orbit_update *update = &record->update;
 		if (DBG) fprintf(stderr, "Orbit: Found update %p, %lu\n",
 				update->ptr, update->length);
 
-		memcpy(update->ptr, update->data, update->length);
+		apply_copy(update->ptr, update->data, update->length);
 
 		extra_size = update->length;
 	} else if (type == ORBIT_OPERATION) {
@@ -665,6 +3026,31 @@ enum orbit_type orbit_apply_one(struct orbit_scratch *s, bool yield)
 		(void)ret;
 
 		extra_size = op->argc * sizeof(*op->argv);
+	} else if (type == ORBIT_DELTA) {
+		if (DBG) fprintf(stderr, "Orbit: Found delta %p, %u\n",
+				record->delta.ptr, record->delta.length);
+
+		delta_apply(&record->delta);
+
+		extra_size = record->delta.size;
+	} else if (type == ORBIT_PACKED) {
+		if (DBG) fprintf(stderr, "Orbit: Found %u packed updates\n",
+				record->packed.count);
+
+		packed_apply(&record->packed);
+
+		extra_size = record->packed.size;
+	} else if (type == ORBIT_BATCH) {
+		unsigned long ret;
+		struct orbit_batch *batch = &record->batch;
+
+		if (DBG) fprintf(stderr, "Orbit: Found batch %p, %u x %u\n",
+				batch->func, batch->count, batch->argc);
+
+		ret = batch->func(batch->count, batch->argc, batch->argv);
+		(void)ret;
+
+		extra_size = repr_extra_size(record);
 	} else if (type == ORBIT_ANY) {
 		if (yield)
 			return ORBIT_ANY;
@@ -679,7 +3065,9 @@ enum orbit_type orbit_apply_one(struct orbit_scratch *s, bool yield)
 	}
 
 	s->cursor += sizeof(struct orbit_repr) + extra_size;
-	s->cursor = round_up_4(s->cursor);
+	s->cursor = round_up_record(s->cursor);
+	s->sub = 0;
+	s->sub_addr = NULL;
 
 	--s->count;
 
@@ -701,6 +3089,159 @@ enum orbit_type orbit_apply(struct orbit_scratch *s, bool yield)
 	return ORBIT_END;
 }
 
+/* Runs of updates smaller than these are not worth splitting */
+#define APPLY_PARALLEL_MIN_RECORDS	1024
+#define APPLY_PARALLEL_MIN_BYTES	(256 * 1024)
+/* Threads used for one run at most, whatever the caller asks for */
+#define APPLY_PARALLEL_MAX_THREADS	64
+
+struct apply_ent {
+	char *start, *end;
+	struct orbit_repr *record;
+};
+
+struct apply_chunk {
+	struct apply_ent *ents;
+	size_t n;
+};
+
+static void *apply_chunk(void *arg)
+{
+	struct apply_chunk *chunk = (struct apply_chunk*)arg;
+
+	for (size_t i = 0; i < chunk->n; ++i) {
+		struct orbit_repr *record = chunk->ents[i].record;
+
+		if (record->type == ORBIT_UPDATE)
+			apply_copy(record->update.ptr, record->update.data,
+				record->update.length);
+		else if (record->type == ORBIT_DELTA)
+			delta_apply(&record->delta);
+		else
+			store_apply(record->type, &record->store);
+	}
+	return NULL;
+}
+
+static int apply_ent_cmp(const void *a, const void *b)
+{
+	const struct apply_ent *x = (const struct apply_ent*)a;
+	const struct apply_ent *y = (const struct apply_ent*)b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Sorts `ents` by address.  Order does not matter if nothing overlaps. */
+static bool apply_ents_overlap(struct apply_ent *ents, size_t n)
+{
+	qsort(ents, n, sizeof(*ents), apply_ent_cmp);
+	for (size_t i = 1; i < n; ++i)
+		if (ents[i].start < ents[i - 1].end)
+			return true;
+	return false;
+}
+
+static void apply_split(struct apply_ent *ents, size_t n, int nthreads)
+{
+	pthread_t thds[APPLY_PARALLEL_MAX_THREADS];
+	struct apply_chunk chunks[APPLY_PARALLEL_MAX_THREADS];
+	bool started[APPLY_PARALLEL_MAX_THREADS];
+
+	/* No more threads than records, so that no chunk is empty */
+	if (nthreads > APPLY_PARALLEL_MAX_THREADS)
+		nthreads = APPLY_PARALLEL_MAX_THREADS;
+	if ((size_t)nthreads > n)
+		nthreads = (int)n;
+
+	for (int i = 0; i < nthreads; ++i) {
+		size_t first = n * i / nthreads, last = n * (i + 1) / nthreads;
+
+		chunks[i] = (struct apply_chunk) { ents + first, last - first };
+		/* The caller takes the first chunk, and any thread that
+		 * fails to start. */
+		started[i] = i > 0 && chunks[i].n > 0 &&
+			pthread_create(&thds[i], NULL, apply_chunk, &chunks[i]) == 0;
+	}
+	for (int i = 0; i < nthreads; ++i)
+		if (!started[i])
+			apply_chunk(&chunks[i]);
+	for (int i = 1; i < nthreads; ++i)
+		if (started[i])
+			pthread_join(thds[i], NULL);
+}
+
+enum orbit_type orbit_apply_parallel(struct orbit_scratch *s, int nthreads)
+{
+	struct apply_ent *ents = NULL;
+	size_t cap = 0;
+	enum orbit_type type = ORBIT_END;
+
+	if (nthreads <= 1)
+		return orbit_apply(s, false);
+
+	while (s->count) {
+		size_t cursor = s->cursor, n = 0, bytes = 0;
+
+		/* Gather updates up to the next record of another type */
+		while (n < s->count) {
+			struct orbit_repr *record =
+				(struct orbit_repr*)((char*)s->ptr + cursor);
+			char *start;
+			size_t length;
+
+			if (record->type == ORBIT_UPDATE) {
+				start = (char*)record->update.ptr;
+				length = record->update.length;
+			} else if (record->type == ORBIT_DELTA) {
+				start = (char*)record->delta.ptr;
+				length = record->delta.length;
+			} else if (is_store(record->type)) {
+				start = (char*)record->store.ptr;
+				length = store_width(record->type);
+			} else {
+				break;
+			}
+
+			if (n == cap) {
+				struct apply_ent *p;
+				cap = cap ? cap * 2 : 1024;
+				p = (struct apply_ent*)realloc(ents,
+						cap * sizeof(*ents));
+				if (p == NULL)
+					break;	/* Apply what we have */
+				ents = p;
+			}
+			ents[n++] = (struct apply_ent) {
+				start, start + length, record };
+			bytes += length;
+			cursor = round_up_record(cursor + sizeof(struct orbit_repr) +
+					repr_extra_size(record));
+		}
+
+		if (n >= 2 && (n >= APPLY_PARALLEL_MIN_RECORDS ||
+			       bytes >= APPLY_PARALLEL_MIN_BYTES) &&
+		    !apply_ents_overlap(ents, n)) {
+			apply_split(ents, n, nthreads);
+			s->cursor = cursor;
+			s->count -= n;
+		} else {
+			for (size_t i = 0; i < n; ++i)
+				orbit_apply_one(s, false);
+		}
+
+		if (s->count == 0)
+			break;
+		/* The barrier, or an update if we ran out of memory */
+		type = orbit_apply_one(s, false);
+		if (type == ORBIT_END || type == ORBIT_UNKNOWN)
+			break;
+		type = ORBIT_END;
+	}
+
+	free(ents);
+	return type;
+}
+
 enum orbit_type orbit_skip_one(struct orbit_scratch *s, bool yield)
 {
 	if (s->count == 0)
@@ -708,31 +3249,17 @@ enum orbit_type orbit_skip_one(struct orbit_scratch *s, bool yield)
 
 	struct orbit_repr *record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
 	enum orbit_type type = record->type;
-	size_t extra_size;
+	ssize_t extra_size = repr_extra_size(record);
 
-	switch (type) {
-	case ORBIT_UPDATE:
-		extra_size = record->update.length;
-		break;
-	case ORBIT_OPERATION:
-		extra_size = record->operation.argc *
-				sizeof(*record->operation.argv);
-		break;
-	case ORBIT_ANY:
-		if (yield)
-			return ORBIT_ANY;
-		extra_size = record->any.length;
-		break;
-	case ORBIT_END:
-		extra_size = 0;
-		break;
-	case ORBIT_UNKNOWN:
-	default:
+	if (extra_size < 0)
 		return ORBIT_UNKNOWN;
-	}
+	if (type == ORBIT_ANY && yield)
+		return ORBIT_ANY;
 
 	s->cursor += sizeof(struct orbit_repr) + extra_size;
-	s->cursor = round_up_4(s->cursor);
+	s->cursor = round_up_record(s->cursor);
+	s->sub = 0;
+	s->sub_addr = NULL;
 	--s->count;
 
 	return type;
@@ -751,6 +3278,31 @@ enum orbit_type orbit_skip(struct orbit_scratch *s, bool yield)
 	return ORBIT_END;
 }
 
+/* The current update of a packed record, as an orbit_update */
+static struct orbit_repr *packed_first(struct orbit_scratch *s,
+		const struct orbit_packed *packed)
+{
+	static __thread struct {
+		struct orbit_repr repr;
+		char data[ORBIT_PACKED_MAX];
+	} buf;
+	char *addr = (char*)s->sub_addr;
+	size_t length;
+	const char *data;
+
+	if (s->sub >= packed->size)
+		return NULL;
+	packed_get(packed->data + s->sub, &addr, &length, &data);
+	if (length > ORBIT_PACKED_MAX)
+		return NULL;
+
+	buf.repr.type = ORBIT_UPDATE;
+	buf.repr.update.ptr = addr;
+	buf.repr.update.length = length;
+	memcpy(buf.repr.update.data, data, length);
+	return &buf.repr;
+}
+
 struct orbit_repr *orbit_scratch_first(struct orbit_scratch *s)
 {
 	if (s->count == 0)
@@ -762,7 +3314,15 @@ struct orbit_repr *orbit_scratch_first(struct orbit_scratch *s)
 	case ORBIT_ANY:
 	case ORBIT_UPDATE:
 	case ORBIT_OPERATION:
+	case ORBIT_DELTA:
+	case ORBIT_STORE8:
+	case ORBIT_STORE16:
+	case ORBIT_STORE32:
+	case ORBIT_STORE64:
+	case ORBIT_BATCH:
 		return record;
+	case ORBIT_PACKED:
+		return packed_first(s, &record->packed);
 	case ORBIT_END:
 	case ORBIT_UNKNOWN:
 	default:
@@ -772,13 +3332,183 @@ struct orbit_repr *orbit_scratch_first(struct orbit_scratch *s)
 
 struct orbit_repr *orbit_scratch_next(struct orbit_scratch *s)
 {
+	struct orbit_repr *record = (struct orbit_repr*)((char*)s->ptr + s->cursor);
+
+	/* Move within a packed record before moving past it */
+	if (s->count && record->type == ORBIT_PACKED) {
+		char *addr = (char*)s->sub_addr;
+		size_t length;
+		const char *data;
+		size_t size = packed_get(record->packed.data + s->sub, &addr,
+				&length, &data);
+
+		if (s->sub + size < record->packed.size) {
+			s->sub += size;
+			s->sub_addr = addr + length;
+			return orbit_scratch_first(s);
+		}
+	}
 	orbit_skip_one(s, false);
 	return orbit_scratch_first(s);
 }
 
+/* Get the index of a received scratch, or NULL if it was sent without one */
+static const struct orbit_index_footer *scratch_index(
+		const struct orbit_scratch *s)
+{
+	const struct orbit_index_footer *footer =
+		index_footer(s, s->size_limit);
+
+	if (footer == NULL || footer->magic != ORBIT_INDEX_MAGIC)
+		return NULL;
+	if (footer->table > (char*)footer - (char*)s->ptr ||
+	    footer->count > ((char*)footer - (char*)s->ptr - footer->table) /
+			    sizeof(struct orbit_index_entry))
+		return NULL;
+	return footer;
+}
+
+static const struct orbit_index_entry *index_table(const struct orbit_scratch *s,
+		const struct orbit_index_footer *footer)
+{
+	return (const struct orbit_index_entry*)((char*)s->ptr + footer->table);
+}
+
+bool orbit_scratch_indexed(const struct orbit_scratch *s)
+{
+	return scratch_index(s) != NULL;
+}
+
+/* Offset of the i-th record by walking from the start, or -1 */
+static ssize_t scratch_walk(const struct orbit_scratch *s, size_t i)
+{
+	size_t offset = 0;
+
+	while (i--) {
+		struct orbit_repr *record =
+			(struct orbit_repr*)((char*)s->ptr + offset);
+		ssize_t extra;
+
+		if (offset + sizeof(struct orbit_repr) > s->size_limit)
+			return -1;
+		extra = repr_extra_size(record);
+		if (extra < 0 || record->type == ORBIT_END)
+			return -1;
+		offset = round_up_record(offset + sizeof(struct orbit_repr) + extra);
+	}
+	if (offset + sizeof(struct orbit_repr) > s->size_limit)
+		return -1;
+	return offset;
+}
+
+/* Number of records sent in the scratch, or -1 if unknown */
+static ssize_t scratch_total(const struct orbit_scratch *s)
+{
+	const struct orbit_index_footer *footer = scratch_index(s);
+	size_t n = 0;
+
+	if (footer)
+		return footer->count;
+
+	/* Without an index, the records left plus the ones before cursor */
+	for (size_t offset = 0; offset < s->cursor; ++n) {
+		ssize_t extra = repr_extra_size(
+			(struct orbit_repr*)((char*)s->ptr + offset));
+		if (extra < 0)
+			return -1;
+		offset = round_up_record(offset + sizeof(struct orbit_repr) + extra);
+	}
+	return n + s->count;
+}
+
+static ssize_t scratch_offset(const struct orbit_scratch *s, size_t i)
+{
+	const struct orbit_index_footer *footer = scratch_index(s);
+	ssize_t total;
+
+	if (footer) {
+		if (i >= footer->count)
+			return -1;
+		return index_table(s, footer)[i].offset;
+	}
+	total = scratch_total(s);
+	if (total < 0 || i >= (size_t)total)
+		return -1;
+	return scratch_walk(s, i);
+}
+
+struct orbit_repr *orbit_scratch_at(const struct orbit_scratch *s, size_t i)
+{
+	ssize_t offset = scratch_offset(s, i);
+
+	if (offset < 0)
+		return NULL;
+	return (struct orbit_repr*)((char*)s->ptr + offset);
+}
+
+size_t orbit_scratch_count_type(const struct orbit_scratch *s,
+		enum orbit_type type)
+{
+	const struct orbit_index_footer *footer = scratch_index(s);
+	ssize_t total;
+	size_t n = 0;
+
+	if (footer) {
+		const struct orbit_index_entry *table = index_table(s, footer);
+		for (size_t i = 0; i < footer->count; ++i)
+			n += table[i].type == (unsigned int)type;
+		return n;
+	}
+
+	total = scratch_total(s);
+	for (size_t offset = 0; total-- > 0; ) {
+		struct orbit_repr *record =
+			(struct orbit_repr*)((char*)s->ptr + offset);
+		ssize_t extra = repr_extra_size(record);
+
+		if (extra < 0)
+			break;
+		n += record->type == type;
+		offset = round_up_record(offset + sizeof(struct orbit_repr) + extra);
+	}
+	return n;
+}
+
+int orbit_scratch_slice(const struct orbit_scratch *s, size_t i, size_t n,
+		struct orbit_scratch *part)
+{
+	ssize_t total = scratch_total(s), offset;
+
+	if (total < 0 || i > (size_t)total || n > (size_t)total - i)
+		return -1;
+	offset = i == (size_t)total ? 0 : scratch_offset(s, i);
+	if (offset < 0)
+		return -1;
+
+	*part = (struct orbit_scratch) {
+		.ptr = s->ptr,
+		.cursor = (size_t)offset,
+		.size_limit = s->size_limit,
+		.count = n,
+		.any_alloc = NULL,
+		.ctx = s->ctx,
+		.flags = s->flags,
+		.orbit = s->orbit,
+	};
+	return 0;
+}
+
 int orbit_recvv_finish(struct orbit_scratch *s)
 {
-	/* return munmap(s->ptr, s->size_limit); */
-	(void)s;
+	struct orbit_scratch_ctx *ctx = s->ctx ? s->ctx : &info.scratch;
+	struct scratch_ctl_entry *e;
+
+	if (!ctx->ctl || !s->orbit)
+		return -1;
+	e = ctl_entry(ctx->ctl, s->orbit, true);
+	if (!e)
+		return -1;
+	/* Seen by the orbit from its next orbit_call on */
+	__atomic_add_fetch(&e->finished, 1, __ATOMIC_RELEASE);
 	return 0;
 }
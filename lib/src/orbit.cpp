@@ -7,13 +7,25 @@ namespace orbit {
 orbit_allocator *__global_allocator;
 
 void set_global_allocator(orbit_allocator *alloc) {
+	/* Let objects allocated before a switch still find their way back */
+	if (alloc && orbit_alloc_scope_remember(alloc) != 0)
+		throw std::length_error("orbit: too many allocators to track");
 	__global_allocator = alloc;
 }
 
+orbit_allocator *current_allocator() {
+	orbit_allocator *alloc = orbit_alloc_scope_current();
+	return alloc ? alloc : __global_allocator;
+}
+
+orbit_allocator *__allocator_of(void *ptr) {
+	return ptr ? orbit_alloc_scope_owner(ptr) : nullptr;
+}
+
 void *__orbit_allocate_wrapper(orbit_allocator *alloc, std::size_t n, std::size_t type_size) {
 	if (n > std::numeric_limits<std::size_t>::max() / type_size)
 		throw std::bad_array_new_length();
-	if (void *p = orbit_alloc(alloc, n * type_size))
+	if (void *p = orbit_try_alloc(alloc, n * type_size))
 		return p;
 	throw std::bad_alloc();
 }
@@ -25,13 +37,27 @@ void __orbit_deallocate_wrapper(orbit_allocator *alloc, void *ptr, std::size_t n
 
 
 void* global_new_operator::operator new(std::size_t size) {
-	void *ptr = orbit_alloc(__global_allocator, size);
+	orbit_allocator *alloc = current_allocator();
+	if (alloc == nullptr)
+		return ::operator new(size);
+	void *ptr = orbit_try_alloc(alloc, size);
 	if (ptr == nullptr) throw std::bad_alloc();
 	return ptr;
 }
 
+void* global_new_operator::operator new[](std::size_t size) {
+	return operator new(size);
+}
+
 void global_new_operator::operator delete(void *ptr) noexcept {
-	orbit_free(__global_allocator, ptr);
+	if (orbit_allocator *alloc = __allocator_of(ptr))
+		orbit_free(alloc, ptr);
+	else
+		::operator delete(ptr);
+}
+
+void global_new_operator::operator delete[](void *ptr) noexcept {
+	operator delete(ptr);
 }
 
 }  // namespace orbit
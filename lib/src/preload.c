@@ -0,0 +1,185 @@
+/*
+ * malloc interposition for orbit.
+ *
+ * Build as liborbit-preload.so and load it with LD_PRELOAD, or link it
+ * before libc.  While a thread has an allocator on its scope stack (see
+ * orbit_alloc_scope_push()), malloc, calloc, realloc and the aligned
+ * variants allocate from that allocator, so structures built by unmodified
+ * code land directly in the orbit pool.  Otherwise everything goes to libc.
+ *
+ * Only allocators created with use_meta are used, since realloc needs to
+ * know object sizes.  free() of an orbit object is handed to orbit_free().
+ * realloc() of a heap object stays on the heap even inside a scope.
+ *
+ * When the allocator in scope is full, allocations fail with ENOMEM like
+ * they would with libc, instead of silently landing on the heap.
+ */
+
+#define _GNU_SOURCE
+#include "orbit.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+/* Set while inside the orbit allocator, whose own heap use must go to libc */
+static __thread bool in_shim;
+
+static struct orbit_allocator *shim_target(void)
+{
+	struct orbit_allocator *alloc;
+
+	if (in_shim)
+		return NULL;
+	alloc = orbit_alloc_scope_current();
+	if (alloc == NULL || !alloc->use_meta)
+		return NULL;
+	return alloc;
+}
+
+static struct orbit_allocator *shim_owner(void *ptr)
+{
+	if (ptr == NULL || in_shim)
+		return NULL;
+	return orbit_alloc_scope_owner(ptr);
+}
+
+static void *shim_alloc(struct orbit_allocator *alloc, size_t size,
+		size_t align)
+{
+	void *ptr;
+
+	in_shim = true;
+	if (align <= ORBIT_ALLOC_ALIGN)
+		ptr = orbit_try_alloc(alloc, size);
+	else
+		ptr = orbit_try_alloc_aligned(alloc, size, align);
+	in_shim = false;
+	return ptr;
+}
+
+void *malloc(size_t size)
+{
+	struct orbit_allocator *alloc = shim_target();
+
+	if (alloc == NULL)
+		return __libc_malloc(size);
+	return shim_alloc(alloc, size, 0);
+}
+
+void free(void *ptr)
+{
+	struct orbit_allocator *alloc = shim_owner(ptr);
+
+	if (alloc == NULL) {
+		__libc_free(ptr);
+		return;
+	}
+	in_shim = true;
+	orbit_free(alloc, ptr);
+	in_shim = false;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	struct orbit_allocator *alloc = shim_target();
+	void *ptr;
+
+	if (alloc == NULL)
+		return __libc_calloc(nmemb, size);
+	if (size != 0 && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	ptr = shim_alloc(alloc, nmemb * size, 0);
+	if (ptr != NULL)
+		memset(ptr, 0, nmemb * size);
+	return ptr;
+}
+
+void *realloc(void *oldptr, size_t size)
+{
+	struct orbit_allocator *owner = shim_owner(oldptr);
+	struct orbit_allocator *alloc;
+	size_t oldsize;
+	void *ptr;
+
+	if (oldptr == NULL)
+		return malloc(size);
+	if (owner == NULL)
+		return __libc_realloc(oldptr, size);
+
+	/* Grow in place if possible, otherwise move to the current scope. */
+	alloc = shim_target();
+	oldsize = orbit_alloc_usable_size(owner, oldptr);
+	if (alloc == owner || oldsize >= size) {
+		in_shim = true;
+		ptr = orbit_try_realloc(owner, oldptr, size);
+		in_shim = false;
+		return ptr;
+	}
+
+	ptr = alloc ? shim_alloc(alloc, size, 0) : __libc_malloc(size);
+	if (ptr == NULL)
+		return NULL;
+	memcpy(ptr, oldptr, oldsize);
+	free(oldptr);
+	return ptr;
+}
+
+static bool valid_align(size_t align)
+{
+	return align != 0 && (align & (align - 1)) == 0;
+}
+
+void *memalign(size_t align, size_t size)
+{
+	struct orbit_allocator *alloc = shim_target();
+
+	if (alloc == NULL)
+		return __libc_memalign(align, size);
+	if (!valid_align(align)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return shim_alloc(alloc, size, align);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+	void *ptr;
+
+	if (!valid_align(align) || align % sizeof(void*) != 0)
+		return EINVAL;
+	ptr = memalign(align, size);
+	if (ptr == NULL)
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	static size_t (*libc_usable_size)(void *ptr);
+	struct orbit_allocator *alloc = shim_owner(ptr);
+
+	if (alloc != NULL)
+		return orbit_alloc_usable_size(alloc, ptr);
+	if (libc_usable_size == NULL)
+		libc_usable_size = (size_t (*)(void*))dlsym(RTLD_NEXT,
+				"malloc_usable_size");
+	return libc_usable_size(ptr);
+}
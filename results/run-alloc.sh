@@ -0,0 +1,15 @@
+#!/bin/bash
+
+# Run next to a Release build of benchmark/alloc.  The CPU count goes first
+# in the log: the 1 to 64 thread sweep only means something with that many
+# cores.
+file=alloc-$(date +%s).log
+
+echo "nproc $(nproc)" >> $file
+lscpu | grep -E '^(Model name|CPU\(s\)|Core\(s\) per socket|Socket\(s\))' >> $file
+
+for i in {0..2}; do
+	echo test$i >> $file
+	./alloc >> $file
+	sleep 1
+done
@@ -0,0 +1,172 @@
+/**
+ * This test file covers the malloc shim in liborbit-preload, which routes
+ * heap allocations into the allocator on the thread's scope stack.
+ *
+ * The test binary links liborbit-preload directly instead of using
+ * LD_PRELOAD.  It does not need orbit support in the kernel.
+ */
+
+#include "orbit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include "acutest.h"
+
+static struct orbit_allocator *make_alloc(bool use_meta)
+{
+	struct orbit_pool *pool = orbit_pool_create(NULL, 4096 * 16);
+	TEST_ASSERT(pool != NULL);
+	return orbit_allocator_from_pool(pool, use_meta);
+}
+
+void test_scope()
+{
+	struct orbit_allocator *alloc = make_alloc(true);
+	struct orbit_allocator *plain = make_alloc(false);
+	char *p, *q;
+
+	TEST_CHECK(orbit_alloc_scope_current() == NULL);
+	TEST_CHECK(orbit_alloc_scope_pop() == -1);
+
+	p = (char*)malloc(32);
+	TEST_CHECK(!orbit_allocated_by((void*)p, alloc));
+	free(p);
+
+	TEST_CHECK(orbit_alloc_scope_push(alloc) == 0);
+	p = (char*)malloc(32);
+	TEST_CHECK(orbit_allocated_by((void*)p, alloc));
+	TEST_CHECK(orbit_alloc_scope_owner(p) == alloc);
+	TEST_CHECK(malloc_usable_size(p) == 32);
+
+	/* NULL suspends routing, allocators without meta are not used */
+	TEST_CHECK(orbit_alloc_scope_push(NULL) == 0);
+	q = (char*)malloc(32);
+	TEST_CHECK(!orbit_allocated_by((void*)q, alloc));
+	TEST_CHECK(orbit_alloc_scope_owner(q) == NULL);
+	free(q);
+	TEST_CHECK(orbit_alloc_scope_push(plain) == 0);
+	q = (char*)malloc(32);
+	TEST_CHECK(!orbit_allocated_by((void*)q, plain));
+	free(q);
+	TEST_CHECK(orbit_alloc_scope_pop() == 0);
+	TEST_CHECK(orbit_alloc_scope_pop() == 0);
+
+	TEST_CHECK(orbit_alloc_scope_current() == alloc);
+	TEST_CHECK(orbit_alloc_scope_pop() == 0);
+
+	/* Objects outlive the scope and can still be freed */
+	free(p);
+
+	orbit_allocator_destroy(alloc);
+	orbit_allocator_destroy(plain);
+}
+
+void test_realloc()
+{
+	struct orbit_allocator *alloc = make_alloc(true);
+	char *p, *q;
+	void *r;
+
+	orbit_alloc_scope_push(alloc);
+	p = (char*)calloc(4, 8);
+	TEST_CHECK(orbit_allocated_by((void*)p, alloc));
+	for (int i = 0; i < 32; ++i)
+		TEST_CHECK(p[i] == 0);
+	memset(p, 'x', 32);
+
+	q = (char*)realloc(p, 1000);
+	TEST_CHECK(orbit_allocated_by((void*)q, alloc));
+	TEST_CHECK(q[0] == 'x' && q[31] == 'x');
+
+	TEST_CHECK(posix_memalign(&r, 256, 100) == 0);
+	TEST_CHECK((uintptr_t)r % 256 == 0);
+	TEST_CHECK(orbit_allocated_by(r, alloc));
+	TEST_CHECK(posix_memalign(&r, 24, 100) != 0);
+	orbit_alloc_scope_pop();
+
+	/* Leaving the scope moves the object back to the heap on growth */
+	p = (char*)realloc(q, 8000);
+	TEST_CHECK(!orbit_allocated_by((void*)p, alloc));
+	TEST_CHECK(p[0] == 'x' && p[31] == 'x');
+	free(p);
+
+	orbit_allocator_destroy(alloc);
+}
+
+void test_full()
+{
+	struct orbit_allocator *alloc = make_alloc(true);
+	void *big, *p, *q, *r, *c, *last = NULL;
+	uintptr_t kept;
+	int big_errno, n = 0;
+
+	/* Check after leaving the scope, acutest may allocate */
+	orbit_alloc_scope_push(alloc);
+	errno = 0;
+	big = malloc(1 << 20);
+	big_errno = errno;
+	while ((p = malloc(1000)) != NULL) {
+		memset(p, 'f', 1000);
+		last = p;
+		++n;
+	}
+	kept = (uintptr_t)last;
+	q = realloc(last, 4000);
+	r = memalign(64, 1000);
+	c = calloc(10, 100);
+	orbit_alloc_scope_pop();
+
+	TEST_CHECK(big == NULL);
+	TEST_CHECK(big_errno == ENOMEM);
+	TEST_CHECK(n > 0);
+	TEST_CHECK(q == NULL);
+	TEST_CHECK(r == NULL);
+	TEST_CHECK(c == NULL);
+	/* A failed realloc keeps the old block */
+	TEST_ASSERT(kept != 0);
+	TEST_CHECK(((char*)kept)[0] == 'f' && ((char*)kept)[999] == 'f');
+
+	orbit_allocator_destroy(alloc);
+}
+
+static void *scope_worker(void *arg)
+{
+	(void)arg;
+	return malloc(16);
+}
+
+void test_thread_local()
+{
+	struct orbit_allocator *alloc = make_alloc(true);
+	pthread_t thd;
+	void *ret;
+
+	/* Scopes are per thread */
+	orbit_alloc_scope_push(alloc);
+	pthread_create(&thd, NULL, scope_worker, NULL);
+	pthread_join(thd, &ret);
+	orbit_alloc_scope_pop();
+	TEST_CHECK(!orbit_allocated_by(ret, alloc));
+	free(ret);
+
+	orbit_allocator_destroy(alloc);
+}
+
+TEST_LIST = {
+    { "scope", test_scope },
+    { "realloc", test_realloc },
+    { "full", test_full },
+    { "thread_local", test_thread_local },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
@@ -0,0 +1,587 @@
+/**
+ * This test file covers the userspace allocator on top of orbit pools.
+ *
+ * The pools here are created without an orbit, so these tests do not need
+ * orbit support in the kernel.
+ */
+
+#include "orbit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "acutest.h"
+
+#define NTHD 4
+#define NALLOC 1000
+#define ORBIT_POOLS 12
+
+struct tcache_args {
+	struct orbit_allocator *alloc;
+	uint64_t *ptrs[NALLOC];
+};
+
+void *tcache_worker(void *_args)
+{
+	struct tcache_args *args = (struct tcache_args*)_args;
+
+	for (int i = 0; i < NALLOC; ++i) {
+		args->ptrs[i] = (uint64_t*)orbit_alloc(args->alloc,
+				sizeof(uint64_t));
+		*args->ptrs[i] = (uintptr_t)args ^ i;
+	}
+	return NULL;
+}
+
+void test_tcache()
+{
+	struct orbit_pool *pool;
+	struct orbit_allocator *alloc;
+	pthread_t thds[NTHD];
+	struct tcache_args args[NTHD];
+
+	pool = orbit_pool_create(NULL, 4096 * 64);
+	TEST_ASSERT(pool != NULL);
+	alloc = orbit_allocator_from_pool(pool, true);
+	TEST_ASSERT(alloc != NULL);
+	TEST_CHECK(orbit_allocator_set_tcache(alloc, 4096) == 0);
+
+	for (int i = 0; i < NTHD; ++i) {
+		args[i].alloc = alloc;
+		pthread_create(&thds[i], NULL, tcache_worker, &args[i]);
+	}
+	for (int i = 0; i < NTHD; ++i)
+		pthread_join(thds[i], NULL);
+
+	/* No allocation should have been overwritten by another thread. */
+	for (int i = 0; i < NTHD; ++i) {
+		for (int j = 0; j < NALLOC; ++j) {
+			TEST_CHECK(orbit_allocated_by((void*)args[i].ptrs[j], alloc));
+			TEST_CHECK(*args[i].ptrs[j] == ((uintptr_t)&args[i] ^ j));
+		}
+	}
+
+	/* Each thread wastes at most one chunk. */
+	size_t needed = NTHD * NALLOC * (sizeof(uint64_t) + sizeof(size_t));
+	TEST_CHECK(pool->used >= needed);
+	TEST_CHECK(pool->used <= needed + NTHD * 4096);
+	TEST_MSG("used %lu, needed %lu", pool->used, needed);
+
+	orbit_allocator_destroy(alloc);
+}
+
+void test_tcache_collide()
+{
+	struct orbit_pool *pools[ORBIT_POOLS];
+	struct orbit_allocator *allocs[ORBIT_POOLS];
+	struct orbit_allocator *tmp[7];
+	size_t needed = 100 * (16 + sizeof(size_t));
+
+	/* Two allocators with ids 8 apart, and more than a thread caches */
+	for (int i = 0; i < ORBIT_POOLS; ++i) {
+		pools[i] = orbit_pool_create(NULL, 4096 * 64);
+		TEST_ASSERT(pools[i] != NULL);
+		allocs[i] = orbit_allocator_from_pool(pools[i], true);
+		TEST_ASSERT(allocs[i] != NULL);
+		TEST_CHECK(orbit_allocator_set_tcache(allocs[i], 4096) == 0);
+		if (i == 0) {
+			for (int j = 0; j < 7; ++j)
+				tmp[j] = orbit_allocator_create(NULL, 0,
+						&pools[0]->used, true);
+			for (int j = 0; j < 7; ++j)
+				orbit_allocator_destroy(tmp[j]);
+		}
+	}
+	TEST_CHECK(allocs[1]->id - allocs[0]->id == 8);
+
+	/* Alternating allocations do not throw away each other's chunks */
+	for (int i = 0; i < 100; ++i) {
+		for (int j = 0; j < 2; ++j)
+			TEST_ASSERT(orbit_alloc(allocs[j], 16) != NULL);
+	}
+	for (int j = 0; j < 2; ++j) {
+		TEST_CHECK(pools[j]->used <= needed + 4096);
+		TEST_MSG("used %lu, needed %lu", pools[j]->used, needed);
+	}
+
+	for (int i = 0; i < 100; ++i) {
+		for (int j = 0; j < ORBIT_POOLS; ++j)
+			TEST_ASSERT(orbit_alloc(allocs[j], 16) != NULL);
+	}
+	for (int j = 0; j < ORBIT_POOLS; ++j) {
+		TEST_CHECK(pools[j]->used <= 2 * needed + 3 * 4096);
+		TEST_MSG("used %lu, needed %lu", pools[j]->used, 2 * needed);
+	}
+
+	for (int i = 0; i < ORBIT_POOLS; ++i)
+		orbit_allocator_destroy(allocs[i]);
+}
+
+void test_group()
+{
+	struct orbit_pool *pool;
+	struct orbit_allocator *alloc;
+	char *a[16], *b[16];
+
+	pool = orbit_pool_create(NULL, 4096 * 16);
+	TEST_ASSERT(pool != NULL);
+	alloc = orbit_allocator_from_pool(pool, false);
+	TEST_ASSERT(alloc != NULL);
+
+	/* Interleaved allocations of two groups should not share pages. */
+	for (int i = 0; i < 16; ++i) {
+		a[i] = (char*)orbit_alloc_in_group(alloc, 1, 64);
+		b[i] = (char*)orbit_alloc_in_group(alloc, 2, 64);
+		(void)orbit_alloc(alloc, 100);
+	}
+	for (int i = 0; i < 16; ++i) {
+		TEST_CHECK((uintptr_t)a[i] / 4096 == (uintptr_t)a[0] / 4096);
+		TEST_CHECK((uintptr_t)b[i] / 4096 == (uintptr_t)b[0] / 4096);
+	}
+	TEST_CHECK((uintptr_t)a[0] / 4096 != (uintptr_t)b[0] / 4096);
+
+	orbit_allocator_destroy(alloc);
+}
+
+void test_mark_release()
+{
+	struct orbit_pool *pool;
+	struct orbit_allocator *alloc;
+	size_t mark, peak = 0;
+	void *first = NULL;
+
+	pool = orbit_pool_create(NULL, 4096 * 4);
+	TEST_ASSERT(pool != NULL);
+	alloc = orbit_allocator_from_pool(pool, true);
+	TEST_ASSERT(alloc != NULL);
+	TEST_CHECK(orbit_allocator_set_tcache(alloc, 1024) == 0);
+
+	(void)orbit_alloc(alloc, 128);
+	mark = orbit_allocator_mark(alloc);
+
+	/* Per-request data reuses the same space every round. */
+	for (int i = 0; i < 100; ++i) {
+		void *req = orbit_alloc(alloc, 256);
+		(void)orbit_alloc_in_group(alloc, 7, 64);
+		if (i == 0)
+			first = req;
+		TEST_CHECK(req == first);
+		if (pool->used > peak)
+			peak = pool->used;
+		TEST_CHECK(orbit_allocator_release(alloc, mark) == 0);
+		TEST_CHECK(pool->used == mark);
+	}
+	TEST_CHECK(peak <= 4096 * 2);
+	TEST_CHECK(orbit_allocator_release(alloc, peak + 1) == -1);
+
+	orbit_allocator_destroy(alloc);
+}
+
+void test_aligned()
+{
+	struct orbit_pool *pool, *meta_pool;
+	struct orbit_allocator *alloc, *meta_alloc;
+	char *p, *q;
+
+	pool = orbit_pool_create(NULL, 4096 * 4);
+	TEST_ASSERT(pool != NULL);
+	alloc = orbit_allocator_from_pool(pool, false);
+	TEST_ASSERT(alloc != NULL);
+
+	/* Without meta, objects are packed without a hidden header. */
+	p = (char*)orbit_alloc(alloc, 8);
+	q = (char*)orbit_alloc(alloc, 8);
+	TEST_CHECK(p == (char*)pool->rawptr);
+	TEST_CHECK(q == p + 8);
+
+	(void)orbit_alloc(alloc, 3);
+	p = (char*)orbit_alloc(alloc, 8);
+	TEST_CHECK((uintptr_t)p % ORBIT_ALLOC_ALIGN == 0);
+
+	p = (char*)orbit_alloc_aligned(alloc, 100, 256);
+	TEST_CHECK((uintptr_t)p % 256 == 0);
+	TEST_CHECK(orbit_alloc_aligned(alloc, 100, 24) == NULL);
+
+	p = (char*)orbit_alloc_isolated(alloc, 8);
+	q = (char*)orbit_alloc(alloc, 8);
+	TEST_CHECK((uintptr_t)p % ORBIT_CACHELINE == 0);
+	TEST_CHECK((uintptr_t)q / ORBIT_CACHELINE != (uintptr_t)p / ORBIT_CACHELINE);
+
+	p = (char*)orbit_alloc_aligned(alloc, 10, 4096);
+	TEST_CHECK((uintptr_t)p % 4096 == 0);
+
+	/* With meta, the header sits right before the aligned object. */
+	meta_pool = orbit_pool_create(NULL, 4096 * 4);
+	TEST_ASSERT(meta_pool != NULL);
+	meta_alloc = orbit_allocator_from_pool(meta_pool, true);
+	TEST_ASSERT(meta_alloc != NULL);
+	(void)orbit_alloc(meta_alloc, 5);
+	p = (char*)orbit_alloc_aligned(meta_alloc, 64, 4096);
+	TEST_CHECK((uintptr_t)p % 4096 == 0);
+	TEST_CHECK(*(size_t*)(p - sizeof(size_t)) == 64);
+	p = (char*)orbit_alloc(meta_alloc, 16);
+	TEST_CHECK((uintptr_t)p % ORBIT_ALLOC_ALIGN == 0);
+
+	orbit_allocator_destroy(alloc);
+	orbit_allocator_destroy(meta_alloc);
+}
+
+void test_chain()
+{
+	struct orbit_pool_chain *chain;
+	struct orbit_allocator *alloc;
+	char *p[100], *big;
+
+	chain = orbit_pool_chain_create(NULL, 4096, true);
+	TEST_ASSERT(chain != NULL);
+	alloc = orbit_pool_chain_allocator(chain);
+	TEST_ASSERT(alloc != NULL);
+
+	/* Spill over to new pools instead of aborting */
+	for (int i = 0; i < 100; ++i) {
+		p[i] = (char*)orbit_alloc(alloc, 100);
+		memset(p[i], i, 100);
+	}
+	TEST_CHECK(chain->npool == 3);
+	for (int i = 0; i < 100; ++i)
+		TEST_CHECK(p[i][0] == i && p[i][99] == i);
+
+	/* Objects larger than a pool get a pool of their own size */
+	big = (char*)orbit_alloc_aligned(alloc, 4096 * 3, 4096);
+	TEST_CHECK((uintptr_t)big % 4096 == 0);
+	TEST_CHECK(chain->npool == 4);
+	TEST_CHECK(chain->members[3].pool->length >= 4096 * 3);
+
+	/* Only touched members are written */
+	for (size_t i = 0; i < chain->npool; ++i)
+		chain->members[i].dirty = false;
+	orbit_pool_chain_touch(chain, p[0]);
+	TEST_CHECK(chain->members[0].dirty);
+	TEST_CHECK(!chain->members[1].dirty);
+	(void)orbit_alloc(alloc, 8);
+	TEST_CHECK(chain->members[3].dirty);
+}
+
+void test_profile()
+{
+	struct orbit_pool *pool;
+	struct orbit_allocator *alloc;
+	struct orbit_alloc_site sites[8];
+	int line_small, line_big;
+	size_t n;
+
+	pool = orbit_pool_create(NULL, 4096 * 64);
+	TEST_ASSERT(pool != NULL);
+	alloc = orbit_allocator_from_pool(pool, false);
+	TEST_ASSERT(alloc != NULL);
+
+	orbit_alloc_profile_reset();
+	TEST_CHECK(orbit_alloc_profile_start(0) == -1);
+	TEST_CHECK(orbit_alloc_profile_start(1) == 0);
+	for (int i = 0; i < 10; ++i) {
+		(void)orbit_alloc(alloc, 16); line_small = __LINE__;
+		(void)orbit_alloc(alloc, 4096); line_big = __LINE__;
+	}
+	orbit_alloc_profile_stop();
+	(void)orbit_alloc(alloc, 16);
+
+	n = orbit_alloc_profile_get(sites, 8);
+	TEST_CHECK(n == 2);
+	for (size_t i = 0; i < n; ++i) {
+		TEST_CHECK(sites[i].pool == pool->rawptr);
+		if (sites[i].line == line_small) {
+			TEST_CHECK(sites[i].bytes == 160);
+			TEST_CHECK(sites[i].count == 10);
+		} else {
+			TEST_CHECK(sites[i].line == line_big);
+			TEST_CHECK(sites[i].bytes == 40960);
+			TEST_CHECK(sites[i].count == 10);
+		}
+	}
+	orbit_alloc_profile_dump(stdout);
+	orbit_alloc_profile_reset();
+	TEST_CHECK(orbit_alloc_profile_get(sites, 8) == 0);
+
+	orbit_allocator_destroy(alloc);
+}
+
+static bool resident(void *addr)
+{
+	unsigned char vec;
+
+	TEST_ASSERT(mincore(addr, 4096, &vec) == 0);
+	return vec & 1;
+}
+
+void test_large()
+{
+	struct orbit_pool *pool;
+	struct orbit_allocator *alloc;
+	struct orbit_range ranges[4];
+	char *small, *big, *big2, *tail, *reuse;
+	size_t used;
+
+	pool = orbit_pool_create(NULL, 4096 * 64);
+	TEST_ASSERT(pool != NULL);
+	alloc = orbit_allocator_from_pool(pool, false);
+	TEST_ASSERT(alloc != NULL);
+	TEST_CHECK(pool->alloc == alloc);
+
+	small = (char*)orbit_alloc(alloc, 100);
+	big = (char*)orbit_alloc(alloc, 4096 * 8);
+	big2 = (char*)orbit_alloc(alloc, 4096 * 8);
+	(void)orbit_alloc(alloc, 100);
+	TEST_CHECK((uintptr_t)big % 4096 == 0);
+	TEST_CHECK(big > small);
+	memset(big, 1, 4096 * 8);
+	TEST_CHECK(resident(big));
+	TEST_CHECK(orbit_pool_ranges(pool, ranges, 4) == 1);
+
+	/* Freed pages are dropped and skipped by snapshots */
+	orbit_free(alloc, big);
+	TEST_CHECK(!resident(big));
+	TEST_CHECK(orbit_pool_ranges(pool, ranges, 4) == 2);
+	TEST_CHECK(ranges[0].start == pool->rawptr);
+	TEST_CHECK(ranges[0].end == big);
+	TEST_CHECK(ranges[1].start == big + 4096 * 8);
+
+	/* A smaller block reuses the front of the hole */
+	reuse = (char*)orbit_alloc(alloc, 4096 * 4);
+	TEST_CHECK(reuse == big);
+	TEST_CHECK(reuse[0] == 0);
+	TEST_CHECK(orbit_pool_ranges(pool, ranges, 4) == 2);
+	TEST_CHECK(ranges[0].end == big + 4096 * 4);
+
+	/* Adjacent holes merge */
+	orbit_free(alloc, big2);
+	TEST_CHECK(orbit_pool_ranges(pool, ranges, 4) == 2);
+	TEST_CHECK(ranges[1].start == big2 + 4096 * 8);
+	TEST_CHECK(orbit_pool_ranges(pool, ranges, 1) == 2);
+	TEST_CHECK(ranges[0].end ==
+		   (char*)pool->rawptr + ((pool->used + 4095) & ~4095UL));
+
+	/* Freeing the last block gives the space back to the bump region */
+	used = pool->used;
+	tail = (char*)orbit_alloc(alloc, 4096 * 16);
+	TEST_CHECK(pool->used > used);
+	orbit_free(alloc, tail);
+	TEST_CHECK(pool->used <= used + 4096);
+	TEST_CHECK(orbit_pool_ranges(pool, NULL, 0) == 2);
+
+	orbit_allocator_destroy(alloc);
+	TEST_CHECK(pool->alloc == NULL);
+	TEST_CHECK(orbit_pool_ranges(pool, ranges, 4) == 1);
+}
+
+void test_large_mark()
+{
+	struct orbit_pool *pool;
+	struct orbit_allocator *alloc;
+	struct orbit_range ranges[4];
+	char *big, *big2, *small, *again, *mark_at, *pages[6];
+	size_t mark, n;
+
+	pool = orbit_pool_create(NULL, 4096 * 64);
+	TEST_ASSERT(pool != NULL);
+	alloc = orbit_allocator_from_pool(pool, false);
+	TEST_ASSERT(alloc != NULL);
+
+	/* Freeing the last block allocated before a mark does not move the
+	 * allocated size below the mark. */
+	(void)orbit_alloc(alloc, 100);
+	big = (char*)orbit_alloc(alloc, 4096 * 4);
+	mark = orbit_allocator_mark(alloc);
+	orbit_free(alloc, big);
+	TEST_CHECK(pool->used >= mark);
+	small = (char*)orbit_alloc(alloc, 100);
+	TEST_CHECK(small >= (char*)pool->rawptr + mark);
+	TEST_CHECK(orbit_allocator_release(alloc, mark) == 0);
+
+	/* A hole merged across the mark is cut back to it on release. */
+	big2 = (char*)orbit_alloc(alloc, 4096 * 4);
+	TEST_CHECK(big2 >= (char*)pool->rawptr + mark);
+	(void)orbit_alloc(alloc, 100);
+	orbit_free(alloc, big2);
+	TEST_CHECK(orbit_allocator_release(alloc, mark) == 0);
+
+	mark_at = (char*)pool->rawptr + mark;
+	for (int i = 0; i < 6; ++i)
+		pages[i] = (char*)orbit_alloc(alloc, 4096);
+	again = (char*)orbit_alloc(alloc, 4096 * 4);
+	TEST_ASSERT(again != NULL);
+	for (int i = 0; i < 6; ++i)
+		TEST_CHECK_(again >= pages[i] + 4096 ||
+			    again + 4096 * 4 <= pages[i],
+			    "pages[%d] overlaps the large block", i);
+
+	/* Snapshots still cover everything allocated since the mark */
+	n = orbit_pool_ranges(pool, ranges, 4);
+	TEST_ASSERT(n <= 4);
+	for (int i = 0; i < 6; ++i) {
+		bool covered = false;
+
+		for (size_t j = 0; j < n; ++j)
+			covered |= (char*)ranges[j].start <= pages[i] &&
+				   pages[i] + 4096 <= (char*)ranges[j].end;
+		TEST_CHECK_(covered, "pages[%d] is in a snapshot range", i);
+	}
+	TEST_CHECK(mark_at <= pages[0]);
+
+	orbit_allocator_destroy(alloc);
+}
+
+void test_meta_ool()
+{
+	struct orbit_pool *pool;
+	struct orbit_allocator *alloc;
+	char *p, *q, *r;
+
+	pool = orbit_pool_create(NULL, 4096 * 4);
+	TEST_ASSERT(pool != NULL);
+	alloc = orbit_allocator_from_pool(pool, true);
+	TEST_ASSERT(alloc != NULL);
+	TEST_CHECK(orbit_allocator_set_meta_ool(alloc) == 0);
+	TEST_CHECK(orbit_allocator_set_meta_ool(alloc) == -1);
+
+	/* Objects are packed without headers */
+	p = (char*)orbit_alloc(alloc, 24);
+	q = (char*)orbit_alloc(alloc, 16);
+	TEST_CHECK(p == (char*)pool->rawptr);
+	TEST_CHECK(q == p + 24);
+	TEST_CHECK(orbit_alloc_usable_size(alloc, p) == 24);
+	TEST_CHECK(orbit_alloc_usable_size(alloc, q) == 16);
+
+	r = (char*)orbit_alloc_aligned(alloc, 64, 64);
+	TEST_CHECK((uintptr_t)r % 64 == 0);
+	TEST_CHECK(orbit_alloc_usable_size(alloc, r) == 64);
+
+	/* realloc still knows the old size */
+	memset(q, 'q', 16);
+	TEST_CHECK(orbit_realloc(alloc, q, 8) == q);
+	TEST_CHECK(orbit_alloc_usable_size(alloc, q) == 8);
+	r = (char*)orbit_realloc(alloc, q, 100);
+	TEST_CHECK(r != q);
+	TEST_CHECK(orbit_alloc_usable_size(alloc, r) == 100);
+	TEST_CHECK(r[0] == 'q' && r[7] == 'q');
+
+	/* Empty objects do not share their entry with the next object */
+	p = (char*)orbit_alloc(alloc, 0);
+	q = (char*)orbit_alloc(alloc, 32);
+	TEST_CHECK(p != q);
+	TEST_CHECK(orbit_alloc_usable_size(alloc, q) == 32);
+	TEST_CHECK(orbit_alloc_usable_size(alloc, p) == ORBIT_ALLOC_ALIGN);
+	memset(q, 'z', 32);
+	TEST_CHECK(orbit_realloc(alloc, q, 16) == q);
+	TEST_CHECK(q[15] == 'z');
+
+	orbit_allocator_destroy(alloc);
+
+	/* Only for allocators with meta, before the first allocation */
+	pool = orbit_pool_create(NULL, 4096);
+	TEST_ASSERT(pool != NULL);
+	alloc = orbit_allocator_from_pool(pool, false);
+	TEST_CHECK(orbit_allocator_set_meta_ool(alloc) == -1);
+	orbit_allocator_destroy(alloc);
+	alloc = orbit_allocator_from_pool(pool, true);
+	(void)orbit_alloc(alloc, 8);
+	TEST_CHECK(orbit_allocator_set_meta_ool(alloc) == -1);
+	orbit_allocator_destroy(alloc);
+}
+
+void test_realloc_tail()
+{
+	struct orbit_pool *pool;
+	struct orbit_allocator *alloc;
+	char *p, *q, *big;
+	size_t used;
+
+	pool = orbit_pool_create(NULL, 4096 * 16);
+	TEST_ASSERT(pool != NULL);
+	alloc = orbit_allocator_from_pool(pool, true);
+	TEST_ASSERT(alloc != NULL);
+
+	/* The last block extends in place, with or without the lock */
+	for (int lockfree = 0; lockfree < 2; ++lockfree) {
+		alloc->lockfree = lockfree;
+		p = (char*)orbit_alloc(alloc, 16);
+		memset(p, 'p', 16);
+		used = pool->used;
+		TEST_CHECK(orbit_realloc(alloc, p, 100) == p);
+		TEST_CHECK(pool->used == used + 84);
+		TEST_CHECK(orbit_alloc_usable_size(alloc, p) == 100);
+
+		q = (char*)orbit_alloc(alloc, 8);
+		q = (char*)orbit_realloc(alloc, p, 200);
+		TEST_CHECK(q != p);
+		TEST_CHECK(q[0] == 'p' && q[15] == 'p');
+	}
+
+	/* Large blocks grow into the rest of their last page */
+	big = (char*)orbit_alloc(alloc, 4096 * 4 + 100);
+	(void)orbit_alloc(alloc, 8);
+	TEST_CHECK(orbit_realloc(alloc, big, 4096 * 5 - 64) == big);
+	TEST_CHECK(orbit_realloc(alloc, big, 4096 * 5 + 64) != big);
+
+	orbit_allocator_destroy(alloc);
+}
+
+void test_grow()
+{
+	struct orbit_pool *pool;
+	struct orbit_allocator *alloc;
+	int *arr = NULL;
+	size_t cap = 0;
+	int moves = 0;
+
+	pool = orbit_pool_create(NULL, 4096 * 16);
+	TEST_ASSERT(pool != NULL);
+	alloc = orbit_allocator_from_pool(pool, false);
+	TEST_ASSERT(alloc != NULL);
+	TEST_CHECK(orbit_allocator_set_tcache(alloc, 1024) == 0);
+
+	for (int i = 0; i < 4096; ++i) {
+		int *old = arr;
+		arr = (int*)orbit_grow(alloc, arr, &cap, (i + 1) * sizeof(int));
+		if (old && arr != old)
+			++moves;
+		arr[i] = i;
+		/* Something else is allocated now and then */
+		if (i % 1000 == 0)
+			(void)orbit_alloc(alloc, 8);
+	}
+	for (int i = 0; i < 4096; ++i)
+		TEST_CHECK(arr[i] == i);
+	TEST_CHECK(cap >= 4096 * sizeof(int));
+	TEST_CHECK(moves <= 14);
+	TEST_MSG("moves %d", moves);
+	/* Dead copies are bounded by the size of the array */
+	TEST_CHECK(pool->used <= 3 * cap + 4096);
+	TEST_MSG("used %lu, capacity %lu", pool->used, cap);
+
+	orbit_allocator_destroy(alloc);
+}
+
+TEST_LIST = {
+    { "tcache", test_tcache },
+    { "tcache_collide", test_tcache_collide },
+    { "group", test_group },
+    { "mark_release", test_mark_release },
+    { "aligned", test_aligned },
+    { "chain", test_chain },
+    { "profile", test_profile },
+    { "large", test_large },
+    { "large_mark", test_large_mark },
+    { "meta_ool", test_meta_ool },
+    { "realloc_tail", test_realloc_tail },
+    { "grow", test_grow },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
@@ -0,0 +1,169 @@
+/**
+ * This test file covers orbit_apply_parallel(): runs of updates split over
+ * threads, operations as barriers between runs, overlapping runs applied
+ * in order, stopping at an unknown record, and asking for far more threads
+ * than a run has updates.
+ */
+
+#include "orbit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "acutest.h"
+#include "scratch-helper.h"
+
+#define SCRATCH_SIZE (4096 * 1024)
+#define NVALUE 20000
+#define NTHD 4
+
+static char buf[SCRATCH_SIZE];
+static unsigned long values[NVALUE];
+static unsigned long seen_sum;
+
+static unsigned long sum_values(size_t argc, unsigned long argv[])
+{
+	(void)argc;
+	(void)argv;
+	seen_sum = 0;
+	for (int i = 0; i < NVALUE; ++i)
+		seen_sum += values[i];
+	return 0;
+}
+
+void test_updates()
+{
+	struct orbit_scratch s;
+	size_t count;
+
+	scratch_init(&s, buf, sizeof(buf), 0);
+	for (int i = 0; i < NVALUE; ++i) {
+		values[i] = i * 3;
+		TEST_ASSERT(orbit_scratch_push_update(&s, &values[i],
+					sizeof(values[i])) > 0);
+	}
+	count = s.count;
+
+	memset(values, 0, sizeof(values));
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_apply_parallel(&s, NTHD) == ORBIT_END);
+	TEST_CHECK(s.count == 0);
+	for (int i = 0; i < NVALUE; ++i)
+		TEST_CHECK_(values[i] == (unsigned long)i * 3, "values[%d]", i);
+}
+
+void test_barrier()
+{
+	struct orbit_scratch s;
+	unsigned long expect = 0;
+	size_t count;
+
+	/* Operations between runs see exactly the updates before them */
+	scratch_init(&s, buf, sizeof(buf), 0);
+	for (int i = 0; i < NVALUE; ++i) {
+		values[i] = 1;
+		orbit_scratch_push_update(&s, &values[i], sizeof(values[i]));
+	}
+	orbit_scratch_push_operation(&s, sum_values, 0, NULL);
+	for (int i = 0; i < NVALUE; ++i) {
+		values[i] = 2;
+		orbit_scratch_push_update(&s, &values[i], sizeof(values[i]));
+		expect += 2;
+	}
+	count = s.count;
+
+	memset(values, 0, sizeof(values));
+	seen_sum = 0;
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_apply_parallel(&s, NTHD) == ORBIT_END);
+	TEST_CHECK(seen_sum == NVALUE);
+	sum_values(0, NULL);
+	TEST_CHECK(seen_sum == expect);
+}
+
+void test_overlap()
+{
+	struct orbit_scratch s;
+	size_t count;
+
+	/* Every value is written twice in the same run, last one wins */
+	scratch_init(&s, buf, sizeof(buf), 0);
+	for (int round = 0; round < 2; ++round) {
+		for (int i = 0; i < NVALUE; ++i) {
+			values[i] = i + round * NVALUE;
+			orbit_scratch_push_update(&s, &values[i],
+					sizeof(values[i]));
+		}
+	}
+	count = s.count;
+
+	memset(values, 0, sizeof(values));
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_apply_parallel(&s, NTHD) == ORBIT_END);
+	for (int i = 0; i < NVALUE; ++i)
+		TEST_CHECK_(values[i] == (unsigned long)i + NVALUE,
+				"values[%d]", i);
+}
+
+void test_unknown()
+{
+	struct orbit_scratch s;
+	struct orbit_repr *record;
+	size_t count;
+
+	scratch_init(&s, buf, sizeof(buf), 0);
+	values[0] = 7;
+	orbit_scratch_push_update(&s, &values[0], sizeof(values[0]));
+	record = (struct orbit_repr*)((char*)s.ptr + s.cursor);
+	orbit_scratch_push_any(&s, NULL, 8);
+	values[1] = 8;
+	orbit_scratch_push_update(&s, &values[1], sizeof(values[1]));
+	count = s.count;
+
+	/* Stops at a record it does not know, like orbit_apply */
+	record->type = ORBIT_UNKNOWN;
+	values[0] = values[1] = 0;
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_apply_parallel(&s, NTHD) == ORBIT_UNKNOWN);
+	TEST_CHECK(values[0] == 7);
+	TEST_CHECK(values[1] == 0);
+}
+
+void test_many_threads()
+{
+	static char big[2][160 * 1024];
+	struct orbit_scratch s;
+	size_t count;
+
+	/* A run large enough to split, with far fewer records than threads
+	 * asked for */
+	scratch_init(&s, buf, sizeof(buf), 0);
+	for (int i = 0; i < 2; ++i) {
+		memset(big[i], 'a' + i, sizeof(big[i]));
+		TEST_ASSERT(orbit_scratch_push_update(&s, big[i],
+					sizeof(big[i])) > 0);
+	}
+	count = s.count;
+
+	memset(big, 0, sizeof(big));
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_apply_parallel(&s, 1 << 20) == ORBIT_END);
+	TEST_CHECK(s.count == 0);
+	TEST_CHECK(big[0][0] == 'a' && big[0][sizeof(big[0]) - 1] == 'a');
+	TEST_CHECK(big[1][0] == 'b' && big[1][sizeof(big[1]) - 1] == 'b');
+}
+
+TEST_LIST = {
+    { "updates", test_updates },
+    { "barrier", test_barrier },
+    { "overlap", test_overlap },
+    { "unknown", test_unknown },
+    { "many_threads", test_many_threads },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
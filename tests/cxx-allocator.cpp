@@ -0,0 +1,198 @@
+/**
+ * This test file covers the C++ allocators and containers in orbit pools.
+ *
+ * The pools here are created without an orbit, so these tests do not need
+ * orbit support in the kernel.
+ */
+
+#include "orbit.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "acutest.h"
+
+static orbit_allocator *make_alloc(bool use_meta)
+{
+	struct orbit_pool *pool = orbit_pool_create(NULL, 4096 * 64);
+	TEST_ASSERT(pool != NULL);
+	return orbit_allocator_from_pool(pool, use_meta);
+}
+
+void test_equality()
+{
+	orbit_allocator *a = make_alloc(false), *b = make_alloc(false);
+	orbit::allocator<int> x(a), y(a), z(b), heap;
+	orbit::allocator<long> rebound(x);
+
+	TEST_CHECK(x == y);
+	TEST_CHECK(!(x != y));
+	TEST_CHECK(x != z);
+	TEST_CHECK(x != heap);
+	TEST_CHECK(rebound == x);
+	TEST_CHECK(rebound.get() == a);
+
+	orbit::global_allocator<int> g1;
+	orbit::global_allocator<long> g2(g1);
+	TEST_CHECK(g1 == g2);
+	TEST_CHECK(!(g1 != g2));
+
+	orbit_allocator_destroy(a);
+	orbit_allocator_destroy(b);
+}
+
+void test_containers()
+{
+	orbit_allocator *alloc = make_alloc(true);
+
+	orbit::vector<int> vec(alloc);
+	for (int i = 0; i < 100; ++i)
+		vec.push_back(i);
+	TEST_CHECK(orbit_allocated_by((void*)vec.data(), alloc));
+
+	orbit::list<int> lst(alloc);
+	orbit::map<int, int> mp(alloc);
+	orbit::unordered_map<int, int> ump(alloc);
+	for (int i = 0; i < 100; ++i) {
+		lst.push_back(i);
+		mp[i] = i * 2;
+		ump[i] = i * 3;
+	}
+	for (auto &v : lst)
+		TEST_CHECK(orbit_allocated_by((void*)&v, alloc));
+	for (auto &kv : mp)
+		TEST_CHECK(orbit_allocated_by((void*)&kv, alloc));
+	for (auto &kv : ump)
+		TEST_CHECK(orbit_allocated_by((void*)&kv, alloc));
+	TEST_CHECK(mp[42] == 84 && ump[42] == 126);
+
+	orbit::string str("a string long enough to not fit in the SSO buffer",
+			  alloc);
+	TEST_CHECK(orbit_allocated_by((void*)str.data(), alloc));
+	str += str;
+	TEST_CHECK(orbit_allocated_by((void*)str.data(), alloc));
+
+	/* The allocator propagates on copy */
+	orbit::vector<int> copy(alloc);
+	copy = vec;
+	TEST_CHECK(copy.get_allocator() == vec.get_allocator());
+	TEST_CHECK(copy[99] == 99);
+
+	orbit::vector<int> heap;
+	heap.push_back(1);
+	TEST_CHECK(!orbit_allocated_by((void*)heap.data(), alloc));
+}
+
+struct node : orbit::global_new_operator {
+	long value[4];
+};
+
+void test_scope()
+{
+	orbit_allocator *a = make_alloc(false), *b = make_alloc(false);
+	orbit_allocator *global = make_alloc(false);
+	orbit::global_allocator<int> galloc;
+
+	/* No allocator at all goes to the heap instead of crashing */
+	orbit::set_global_allocator(nullptr);
+	node *n = new node;
+	TEST_CHECK(!orbit_allocated_by(n, a));
+	delete n;
+
+	{
+		orbit::alloc_scope outer(a);
+		n = new node;
+		TEST_CHECK(orbit_allocated_by(n, a));
+		{
+			orbit::alloc_scope inner(b);
+			node *arr = new node[4];
+			TEST_CHECK(orbit_allocated_by(arr, b));
+			delete[] arr;
+			int *p = galloc.allocate(10);
+			TEST_CHECK(orbit_allocated_by(p, b));
+			galloc.deallocate(p, 10);
+		}
+		TEST_CHECK(orbit::current_allocator() == a);
+	}
+	/* Freed to its own pool after the scope ends */
+	delete n;
+	TEST_CHECK(orbit::current_allocator() == nullptr);
+
+	/* Other threads are not affected by the scope of this one */
+	orbit::set_global_allocator(global);
+	{
+		orbit::alloc_scope guard(a);
+		node *theirs = nullptr;
+		std::thread thd([&] { theirs = new node; });
+		thd.join();
+		TEST_CHECK(orbit_allocated_by(theirs, global));
+		delete theirs;
+	}
+	int *p = galloc.allocate(10);
+	TEST_CHECK(orbit_allocated_by(p, global));
+	orbit::set_global_allocator(nullptr);
+	galloc.deallocate(p, 10);
+
+	orbit_allocator_destroy(a);
+	orbit_allocator_destroy(b);
+	orbit_allocator_destroy(global);
+}
+
+void test_owner_full()
+{
+	orbit_allocator *extra = make_alloc(false);
+	std::vector<orbit_allocator*> tracked;
+	bool thrown = false;
+
+	/* Fill the table of allocators that frees are looked up in */
+	for (;;) {
+		orbit_allocator *alloc = make_alloc(false);
+		if (orbit_alloc_scope_remember(alloc) != 0) {
+			orbit_allocator_destroy(alloc);
+			break;
+		}
+		tracked.push_back(alloc);
+	}
+	TEST_CHECK(!tracked.empty());
+
+	try {
+		orbit::set_global_allocator(extra);
+	} catch (const std::length_error &) {
+		thrown = true;
+	}
+	TEST_CHECK(thrown);
+	TEST_CHECK(orbit::current_allocator() == nullptr);
+
+	thrown = false;
+	try {
+		orbit::alloc_scope guard(extra);
+	} catch (const std::length_error &e) {
+		thrown = strstr(e.what(), "too many allocators") != nullptr;
+	}
+	TEST_CHECK(thrown);
+	TEST_CHECK(orbit::current_allocator() == nullptr);
+
+	/* Destroyed allocators make room again */
+	for (orbit_allocator *alloc : tracked)
+		orbit_allocator_destroy(alloc);
+	orbit::set_global_allocator(extra);
+	TEST_CHECK(orbit::current_allocator() == extra);
+	orbit::set_global_allocator(nullptr);
+	orbit_allocator_destroy(extra);
+}
+
+TEST_LIST = {
+    { "equality", test_equality },
+    { "containers", test_containers },
+    { "scope", test_scope },
+    { "owner_full", test_owner_full },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
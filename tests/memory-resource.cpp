@@ -0,0 +1,121 @@
+/**
+ * This test file covers orbit::memory_resource, which needs C++17.
+ *
+ * The pools and the scratch here are created without an orbit, so these
+ * tests do not need orbit support in the kernel.
+ */
+
+#include "orbit.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <vector>
+#include "acutest.h"
+
+static orbit_allocator *make_alloc(bool use_meta)
+{
+	struct orbit_pool *pool = orbit_pool_create(NULL, 4096 * 64);
+	TEST_ASSERT(pool != NULL);
+	return orbit_allocator_from_pool(pool, use_meta);
+}
+
+void test_pool()
+{
+	orbit_allocator *alloc = make_alloc(false), *other = make_alloc(false);
+	orbit::memory_resource res(alloc), same(alloc), diff(other);
+
+	std::pmr::vector<int> vec(&res);
+	for (int i = 0; i < 100; ++i)
+		vec.push_back(i);
+	TEST_CHECK(orbit_allocated_by(vec.data(), alloc));
+
+	std::pmr::map<int, std::pmr::string> mp(&res);
+	mp[1] = "a string long enough to not fit in the SSO buffer";
+	TEST_CHECK(orbit_allocated_by(&*mp.begin(), alloc));
+	TEST_CHECK(orbit_allocated_by(mp[1].data(), alloc));
+
+	/* Alignment requests are respected */
+	void *p = res.allocate(100, 256);
+	TEST_CHECK((uintptr_t)p % 256 == 0);
+	TEST_CHECK(orbit_allocated_by(p, alloc));
+	res.deallocate(p, 100, 256);
+
+	TEST_CHECK(res == same);
+	TEST_CHECK(res != diff);
+	TEST_CHECK(res != *std::pmr::new_delete_resource());
+
+	/* Upstream of a monotonic buffer */
+	std::pmr::monotonic_buffer_resource mono(1024, &res);
+	std::pmr::vector<long> longs(&mono);
+	longs.resize(1000);
+	TEST_CHECK(orbit_allocated_by(longs.data(), alloc));
+}
+
+void test_scratch()
+{
+	struct orbit_scratch s;
+	size_t size = 4096 * 4;
+	orbit_allocator *alloc;
+
+	/* A scratch over plain memory */
+	memset(&s, 0, sizeof(s));
+	s.ptr = aligned_alloc(4096, size);
+	s.size_limit = size;
+	s.cursor = 0;
+	s.count = 0;
+	s.any_alloc = NULL;
+
+	alloc = orbit_scratch_open_any(&s, false);
+	TEST_ASSERT(alloc != NULL);
+	{
+		orbit::memory_resource res(alloc);
+		std::pmr::vector<int> vec(&res);
+		vec.reserve(100);
+		for (int i = 0; i < 100; ++i)
+			vec.push_back(i);
+		TEST_CHECK(orbit_allocated_by(vec.data(), alloc));
+		TEST_CHECK((char*)vec.data() > (char*)s.ptr);
+		TEST_CHECK((char*)vec.data() < (char*)s.ptr + size);
+	}
+	TEST_CHECK(orbit_scratch_close_any(&s) == 1);
+	TEST_CHECK(s.cursor >= 100 * sizeof(int));
+
+	/* Running out of scratch space throws instead of aborting */
+	alloc = orbit_scratch_open_any(&s, false);
+	TEST_ASSERT(alloc != NULL);
+	{
+		orbit::memory_resource res(alloc);
+		std::pmr::vector<char> vec(&res);
+		bool thrown = false;
+
+		try {
+			vec.resize(size);
+		} catch (const std::bad_alloc &) {
+			thrown = true;
+		}
+		TEST_CHECK(thrown);
+		TEST_CHECK(vec.empty());
+		vec.resize(100);
+		TEST_CHECK(orbit_allocated_by(vec.data(), alloc));
+	}
+	TEST_CHECK(orbit_scratch_close_any(&s) == 2);
+
+	free(s.ptr);
+}
+
+TEST_LIST = {
+    { "pool", test_pool },
+    { "scratch", test_scratch },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
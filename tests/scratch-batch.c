@@ -0,0 +1,197 @@
+/**
+ * This test file covers batch records: thousands of calls to one function
+ * going into a single record, a new batch starting at any other record,
+ * skipping a batch as a whole, and a batch filling a small scratch.
+ */
+
+#include "orbit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "acutest.h"
+#include "scratch-helper.h"
+
+#define SCRATCH_SIZE (4096 * 64)
+#define NTRX 5000
+
+static char buf[SCRATCH_SIZE];
+
+/* Like the transactions a deadlock checker marks as victims */
+struct trx_t {
+	unsigned long id;
+	int victim;
+	unsigned long weight;
+};
+
+static struct trx_t trxs[NTRX];
+static size_t ncall;
+static size_t nmarked;
+static unsigned long log_sum;
+
+/* Each tuple is (trx, weight) */
+static unsigned long mark_victims(size_t count, size_t argc,
+		unsigned long argv[])
+{
+	++ncall;
+	for (size_t i = 0; i < count; ++i) {
+		struct trx_t *trx = (struct trx_t*)argv[i * argc];
+
+		trx->victim = 1;
+		trx->weight = argv[i * argc + 1];
+		++nmarked;
+	}
+	return 0;
+}
+
+static unsigned long log_ids(size_t count, size_t argc, unsigned long argv[])
+{
+	++ncall;
+	for (size_t i = 0; i < count * argc; ++i)
+		log_sum += argv[i];
+	return 0;
+}
+
+static unsigned long log_one(size_t argc, unsigned long argv[])
+{
+	(void)argc;
+	log_sum += argv[0] * 1000;
+	return 0;
+}
+
+static void push_victim(struct orbit_scratch *s, int i)
+{
+	unsigned long argv[] = { (unsigned long)&trxs[i], (unsigned long)i * 7 };
+
+	TEST_ASSERT(orbit_scratch_push_batch(s, mark_victims, 2, argv) > 0);
+}
+
+static void reset(void)
+{
+	memset(trxs, 0, sizeof(trxs));
+	ncall = nmarked = 0;
+	log_sum = 0;
+}
+
+void test_one_call()
+{
+	struct orbit_scratch s;
+	struct orbit_repr *record;
+	size_t count;
+
+	scratch_init(&s, buf, sizeof(buf), 0);
+	for (int i = 0; i < NTRX; ++i)
+		push_victim(&s, i);
+	count = s.count;
+	TEST_CHECK(count == 1);
+	TEST_CHECK(s.cursor == sizeof(struct orbit_repr) +
+			NTRX * 2 * sizeof(unsigned long));
+
+	scratch_rewind(&s, count);
+	record = orbit_scratch_first(&s);
+	TEST_ASSERT(record != NULL);
+	TEST_CHECK(record->type == ORBIT_BATCH);
+	TEST_CHECK(record->batch.func == mark_victims);
+	TEST_CHECK(record->batch.argc == 2);
+	TEST_CHECK(record->batch.count == NTRX);
+	TEST_CHECK(orbit_scratch_next(&s) == NULL);
+
+	reset();
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+	TEST_CHECK(ncall == 1);
+	TEST_CHECK(nmarked == NTRX);
+	for (int i = 0; i < NTRX; ++i) {
+		TEST_CHECK_(trxs[i].victim && trxs[i].weight ==
+				(unsigned long)i * 7, "trxs[%d]", i);
+	}
+}
+
+void test_order()
+{
+	struct orbit_scratch s;
+	unsigned long id = 1;
+	unsigned long three[] = { 1, 2, 3 };
+	size_t count;
+
+	/* A different func, argc or record in between starts a new batch */
+	scratch_init(&s, buf, sizeof(buf), 0);
+	push_victim(&s, 0);
+	push_victim(&s, 1);
+	TEST_CHECK(orbit_scratch_push_batch(&s, log_ids, 1, &id) == 2);
+	TEST_CHECK(orbit_scratch_push_batch(&s, log_ids, 1, &id) == 2);
+	TEST_CHECK(orbit_scratch_push_batch(&s, log_ids, 3, three) == 3);
+	TEST_CHECK(orbit_scratch_push_operation(&s, log_one, 1, &id) == 4);
+	TEST_CHECK(orbit_scratch_push_batch(&s, log_ids, 3, three) == 5);
+	push_victim(&s, 2);
+	count = s.count;
+	TEST_CHECK(count == 6);
+
+	reset();
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+	TEST_CHECK(ncall == 5);
+	TEST_CHECK(nmarked == 3);
+	TEST_CHECK(trxs[2].victim && trxs[2].weight == 14);
+	TEST_CHECK(log_sum == 1 + 1 + 6 + 1000 + 6);
+}
+
+void test_skip()
+{
+	struct orbit_scratch s;
+	size_t count;
+
+	scratch_init(&s, buf, sizeof(buf), 0);
+	for (int i = 0; i < 10; ++i)
+		push_victim(&s, i);
+	TEST_CHECK(orbit_scratch_push_update(&s, &trxs[0].id,
+				sizeof(trxs[0].id)) == 2);
+	/* Compaction keeps the batch as it is */
+	TEST_CHECK(orbit_scratch_compact(&s) == 2);
+	count = s.count;
+
+	/* Skipping goes past the whole batch without calling it */
+	reset();
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_skip_one(&s, false) == ORBIT_BATCH);
+	TEST_CHECK(ncall == 0);
+	TEST_CHECK(orbit_scratch_first(&s)->type == ORBIT_UPDATE);
+
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_apply_parallel(&s, 4) == ORBIT_END);
+	TEST_CHECK(ncall == 1);
+	TEST_CHECK(nmarked == 10);
+}
+
+void test_no_room()
+{
+	struct orbit_scratch s;
+	int n = 0;
+
+	scratch_init(&s, buf, sizeof(buf), 0);
+	s.size_limit = sizeof(struct orbit_repr) + 4 * 2 * sizeof(unsigned long);
+	while (n < 10) {
+		unsigned long argv[] = { (unsigned long)&trxs[n], 0 };
+
+		if (orbit_scratch_push_batch(&s, mark_victims, 2, argv) < 0)
+			break;
+		++n;
+	}
+	TEST_CHECK(n == 4);
+	TEST_CHECK(s.count == 1);
+	TEST_CHECK(s.cursor == s.size_limit);
+}
+
+TEST_LIST = {
+    { "one_call", test_one_call },
+    { "order", test_order },
+    { "skip", test_skip },
+    { "no_room", test_no_room },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
@@ -0,0 +1,174 @@
+/**
+ * This test file covers orbit_scratch_compact(): a thousand writes to one
+ * counter collapse into one update, overlapping and adjacent ranges merge
+ * with the last write to each byte winning, operations stay barriers that
+ * updates are not moved across, and nothing up to the last any record
+ * moves.
+ */
+
+#include "orbit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "acutest.h"
+#include "scratch-helper.h"
+
+#define SCRATCH_SIZE (4096 * 16)
+
+static char buf[SCRATCH_SIZE];
+
+void test_counter()
+{
+	struct orbit_scratch s;
+	unsigned long counter = 0;
+
+	scratch_init(&s, buf, sizeof(buf), 0);
+	for (int i = 0; i < 1000; ++i) {
+		++counter;
+		TEST_ASSERT(orbit_scratch_push_update(&s, &counter,
+					sizeof(counter)) == i + 1);
+	}
+
+	TEST_CHECK(orbit_scratch_compact(&s) == 1);
+	TEST_CHECK(s.cursor == sizeof(struct orbit_repr) + sizeof(counter));
+
+	counter = 0;
+	scratch_rewind(&s, 1);
+	TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+	TEST_CHECK(counter == 1000);
+}
+
+void test_merge()
+{
+	struct orbit_scratch s;
+	char data[64], expect[64];
+	struct orbit_repr *record;
+
+	memset(data, 0, sizeof(data));
+	scratch_init(&s, buf, sizeof(buf), 0);
+
+	/* Overlapping: [8, 24) then [16, 32) */
+	memset(data + 8, 'a', 16);
+	orbit_scratch_push_update(&s, data + 8, 16);
+	memset(data + 16, 'b', 16);
+	orbit_scratch_push_update(&s, data + 16, 16);
+	/* Adjacent: [32, 40) */
+	memset(data + 32, 'c', 8);
+	orbit_scratch_push_update(&s, data + 32, 8);
+	/* Disjoint: [48, 56), pushed twice */
+	memset(data + 48, 'd', 8);
+	orbit_scratch_push_update(&s, data + 48, 8);
+	memset(data + 48, 'e', 4);
+	orbit_scratch_push_update(&s, data + 48, 4);
+	/* Inside an earlier range, last one wins */
+	memset(data + 10, 'f', 2);
+	orbit_scratch_push_update(&s, data + 10, 2);
+
+	memcpy(expect, data, sizeof(data));
+	TEST_CHECK(orbit_scratch_compact(&s) == 2);
+
+	scratch_rewind(&s, 2);
+	record = orbit_scratch_first(&s);
+	TEST_ASSERT(record != NULL && record->type == ORBIT_UPDATE);
+	TEST_CHECK(record->update.ptr == data + 8);
+	TEST_CHECK(record->update.length == 32);
+	record = orbit_scratch_next(&s);
+	TEST_ASSERT(record != NULL && record->type == ORBIT_UPDATE);
+	TEST_CHECK(record->update.ptr == data + 48);
+	TEST_CHECK(record->update.length == 8);
+
+	memset(data, 0, sizeof(data));
+	scratch_rewind(&s, 2);
+	TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+	TEST_CHECK(memcmp(data, expect, sizeof(data)) == 0);
+}
+
+static unsigned long seen;
+
+static unsigned long read_value(size_t argc, unsigned long argv[])
+{
+	(void)argc;
+	seen = *(unsigned long*)argv[0];
+	return 0;
+}
+
+void test_operation_barrier()
+{
+	struct orbit_scratch s;
+	unsigned long value;
+	unsigned long argv[] = { (unsigned long)&value };
+
+	scratch_init(&s, buf, sizeof(buf), 0);
+	value = 1;
+	orbit_scratch_push_update(&s, &value, sizeof(value));
+	value = 2;
+	orbit_scratch_push_update(&s, &value, sizeof(value));
+	orbit_scratch_push_operation(&s, read_value, 1, argv);
+	value = 3;
+	orbit_scratch_push_update(&s, &value, sizeof(value));
+	value = 4;
+	orbit_scratch_push_update(&s, &value, sizeof(value));
+
+	/* update, operation, update */
+	TEST_CHECK(orbit_scratch_compact(&s) == 3);
+
+	value = 0;
+	seen = 0;
+	scratch_rewind(&s, 3);
+	TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+	TEST_CHECK(seen == 2);
+	TEST_CHECK(value == 4);
+}
+
+void test_any_pinned()
+{
+	struct orbit_scratch s;
+	unsigned long value;
+	unsigned long *obj;
+	struct orbit_repr *record;
+
+	scratch_init(&s, buf, sizeof(buf), 0);
+	value = 1;
+	orbit_scratch_push_update(&s, &value, sizeof(value));
+	value = 2;
+	orbit_scratch_push_update(&s, &value, sizeof(value));
+	obj = (unsigned long*)orbit_scratch_push_any(&s, NULL, sizeof(*obj));
+	TEST_ASSERT(obj != NULL);
+	*obj = 0xabcd;
+	value = 3;
+	orbit_scratch_push_update(&s, &value, sizeof(value));
+	value = 4;
+	orbit_scratch_push_update(&s, &value, sizeof(value));
+
+	/* Records up to the any stay where they are, the rest is merged */
+	TEST_CHECK(orbit_scratch_compact(&s) == 4);
+	TEST_CHECK(*obj == 0xabcd);
+
+	scratch_rewind(&s, 4);
+	record = orbit_scratch_first(&s);
+	TEST_ASSERT(record != NULL);
+	TEST_CHECK(*(unsigned long*)record->update.data == 1);
+	orbit_scratch_next(&s);
+	record = orbit_scratch_next(&s);
+	TEST_ASSERT(record != NULL && record->type == ORBIT_ANY);
+	TEST_CHECK(record->any.data == (char*)obj);
+	record = orbit_scratch_next(&s);
+	TEST_ASSERT(record != NULL && record->type == ORBIT_UPDATE);
+	TEST_CHECK(*(unsigned long*)record->update.data == 4);
+	TEST_CHECK(orbit_scratch_next(&s) == NULL);
+}
+
+TEST_LIST = {
+    { "counter", test_counter },
+    { "merge", test_merge },
+    { "operation_barrier", test_operation_barrier },
+    { "any_pinned", test_any_pinned },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
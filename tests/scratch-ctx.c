@@ -0,0 +1,218 @@
+/**
+ * This test file covers scratch contexts: concurrent space reservation and
+ * moving along the ring of pools.
+ *
+ * Nothing is sent here, so these tests do not need orbit support in the
+ * kernel.
+ */
+
+#include "orbit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "acutest.h"
+
+#define NTHD 4
+#define NSCRATCH 16
+
+struct reserve_args {
+	struct orbit_scratch_ctx *ctx;
+	struct orbit_scratch s[NSCRATCH];
+	unsigned long data;
+};
+
+void *reserve_worker(void *_args)
+{
+	struct reserve_args *args = (struct reserve_args*)_args;
+
+	for (int i = 0; i < NSCRATCH; ++i) {
+		if (orbit_scratch_create_in(args->ctx, &args->s[i], 4096) != 0)
+			return (void*)-1;
+		if (orbit_scratch_push_update(&args->s[i], &args->data,
+					sizeof(args->data)) != 1)
+			return (void*)-1;
+	}
+	return NULL;
+}
+
+static int cmp_ptr(const void *a, const void *b)
+{
+	char *x = *(char**)a, *y = *(char**)b;
+	return x < y ? -1 : x > y;
+}
+
+static void pool_destroy(struct orbit_pool *pool)
+{
+	munmap(pool->rawptr, pool->length);
+	free(pool);
+}
+
+void test_concurrent_create()
+{
+	struct orbit_pool *pool;
+	struct orbit_scratch_ctx *ctx;
+	pthread_t thds[NTHD];
+	struct reserve_args args[NTHD];
+	char *ptrs[NTHD * NSCRATCH];
+	void *ret;
+
+	/* One control page, then a page for each scratch */
+	pool = orbit_pool_create(NULL, 4096 * (1 + NTHD * NSCRATCH));
+	TEST_ASSERT(pool != NULL);
+	ctx = orbit_scratch_ctx_create(NULL, pool);
+	TEST_ASSERT(ctx != NULL);
+
+	for (int i = 0; i < NTHD; ++i) {
+		args[i].ctx = ctx;
+		args[i].data = 0x5a5a0000 + i;
+		pthread_create(&thds[i], NULL, reserve_worker, &args[i]);
+	}
+	for (int i = 0; i < NTHD; ++i) {
+		pthread_join(thds[i], &ret);
+		TEST_CHECK(ret == NULL);
+	}
+
+	/* Every scratch got its own page of the pool. */
+	for (int i = 0; i < NTHD; ++i) {
+		for (int j = 0; j < NSCRATCH; ++j) {
+			struct orbit_scratch *s = &args[i].s[j];
+			TEST_CHECK(s->size_limit == 4096);
+			TEST_CHECK(s->count == 1);
+			ptrs[i * NSCRATCH + j] = (char*)s->ptr;
+		}
+	}
+	qsort(ptrs, NTHD * NSCRATCH, sizeof(ptrs[0]), cmp_ptr);
+	for (int i = 0; i < NTHD * NSCRATCH; ++i) {
+		TEST_CHECK(ptrs[i] >= (char*)pool->rawptr + 4096);
+		TEST_CHECK(ptrs[i] < (char*)pool->rawptr + pool->length);
+		if (i > 0)
+			TEST_CHECK(ptrs[i] - ptrs[i - 1] == 4096);
+	}
+
+	for (int i = 0; i < NTHD; ++i)
+		for (int j = 0; j < NSCRATCH; ++j)
+			TEST_CHECK(orbit_scratch_discard(&args[i].s[j]) == 0);
+
+	orbit_scratch_ctx_destroy(ctx);
+	pool_destroy(pool);
+}
+
+void test_ring()
+{
+	struct orbit_pool *pool;
+	struct orbit_scratch_ctx *ctx;
+	struct orbit_scratch s[32], extra;
+	int n;
+
+	/* The user's pool has a control page and room for two scratches;
+	 * each pool created for the ring has room for three. */
+	pool = orbit_pool_create(NULL, 4096 * 3);
+	TEST_ASSERT(pool != NULL);
+	ctx = orbit_scratch_ctx_create(NULL, pool);
+	TEST_ASSERT(ctx != NULL);
+
+	for (n = 0; n < 32; ++n)
+		if (orbit_scratch_create_in(ctx, &s[n], 4096) != 0)
+			break;
+	TEST_CHECK(n == 2 + 7 * 3);
+	TEST_MSG("created %d scratches", n);
+
+	/* The first pool is reused once nothing in it is pending. */
+	TEST_CHECK(orbit_scratch_discard(&s[0]) == 0);
+	TEST_CHECK(orbit_scratch_create_in(ctx, &extra, 4096) != 0);
+	TEST_CHECK(orbit_scratch_discard(&s[1]) == 0);
+	TEST_CHECK(orbit_scratch_create_in(ctx, &extra, 4096) == 0);
+	TEST_CHECK(extra.ptr == (char*)pool->rawptr + 4096);
+
+	/* Only received scratches are counted, under the orbit they came from */
+	TEST_CHECK(orbit_recvv_finish(&extra) == -1);
+
+	orbit_scratch_ctx_destroy(ctx);
+	pool_destroy(pool);
+}
+
+void test_whole_pool()
+{
+	struct orbit_pool *pool;
+	struct orbit_scratch_ctx *ctx;
+	struct orbit_scratch s, t;
+
+	pool = orbit_pool_create(NULL, 4096 * 8);
+	TEST_ASSERT(pool != NULL);
+	ctx = orbit_scratch_ctx_create(NULL, pool);
+	TEST_ASSERT(ctx != NULL);
+
+	/* Size 0 takes the rest of the pool, as orbit_scratch_create() does */
+	TEST_CHECK(orbit_scratch_create_in(ctx, &s, 0) == 0);
+	TEST_CHECK(s.ptr == (char*)pool->rawptr + 4096);
+	TEST_CHECK(s.size_limit == pool->length - 4096);
+
+	/* A discarded scratch gives its space back */
+	TEST_CHECK(orbit_scratch_discard(&s) == 0);
+	TEST_CHECK(orbit_scratch_create_in(ctx, &t, 4096) == 0);
+	TEST_CHECK(t.ptr == s.ptr);
+	TEST_CHECK(orbit_scratch_discard(&t) == 0);
+
+	/* Larger than any pool of the ring */
+	TEST_CHECK(orbit_scratch_create_in(ctx, &t, pool->length) != 0);
+
+	orbit_scratch_ctx_destroy(ctx);
+	pool_destroy(pool);
+}
+
+void test_autoflush()
+{
+	struct orbit_pool *pool;
+	struct orbit_scratch_ctx *ctx;
+	struct orbit_scratch s, plain;
+	unsigned long value = 42;
+	int n;
+
+	pool = orbit_pool_create(NULL, 4096 * 4);
+	TEST_ASSERT(pool != NULL);
+	ctx = orbit_scratch_ctx_create(NULL, pool);
+	TEST_ASSERT(ctx != NULL);
+
+	/* A scratch not from a context has nowhere to continue */
+	plain = (struct orbit_scratch) { .ptr = NULL };
+	TEST_CHECK(orbit_scratch_set_autoflush(&plain, 4096) == -1);
+	TEST_CHECK(orbit_scratch_set_autoflush(&plain, 0) == 0);
+
+	TEST_CHECK(orbit_scratch_create_in(ctx, &s, 4096) == 0);
+	TEST_CHECK(s.flush_threshold == 0);
+	TEST_CHECK(orbit_scratch_set_autoflush(&s, 1024) == 0);
+
+	/* Nothing to send yet */
+	TEST_CHECK(orbit_scratch_flush(&s) == 0);
+
+	/* Without an orbit, sending fails, and records stay in the scratch
+	 * until it is full. */
+	for (n = 0; n < 4096; ++n)
+		if (orbit_scratch_push_update(&s, &value, sizeof(value)) < 0)
+			break;
+	TEST_CHECK(n == 4096 / (sizeof(struct orbit_repr) + sizeof(value)));
+	TEST_CHECK((size_t)n == s.count);
+	TEST_CHECK(orbit_scratch_flush(&s) == -1);
+	TEST_CHECK(s.count == (size_t)n);
+
+	TEST_CHECK(orbit_scratch_discard(&s) == 0);
+	orbit_scratch_ctx_destroy(ctx);
+	pool_destroy(pool);
+}
+
+TEST_LIST = {
+    { "concurrent_create", test_concurrent_create },
+    { "ring", test_ring },
+    { "whole_pool", test_whole_pool },
+    { "autoflush", test_autoflush },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
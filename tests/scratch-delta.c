@@ -0,0 +1,127 @@
+/**
+ * This test file covers delta-encoded updates: a few scattered changes in a
+ * large range take little space, an unchanged range takes no runs, dense
+ * changes fall back to a plain update, and a delta still fits in a scratch
+ * too small for the whole range.
+ */
+
+#include "orbit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "acutest.h"
+#include "scratch-helper.h"
+
+#define SCRATCH_SIZE (4096 * 16)
+#define RANGE_SIZE (4096 * 4)
+
+static char buf[SCRATCH_SIZE];
+static char range[RANGE_SIZE], orig[RANGE_SIZE], expect[RANGE_SIZE];
+
+/* Fill the range, keep a copy as the original, and apply `count` changes */
+static void range_init(int count, size_t stride)
+{
+	for (size_t i = 0; i < RANGE_SIZE; ++i)
+		range[i] = (char)(i * 7);
+	memcpy(orig, range, RANGE_SIZE);
+	for (int i = 0; i < count; ++i)
+		range[(i * stride) % RANGE_SIZE] ^= 0xff;
+	memcpy(expect, range, RANGE_SIZE);
+}
+
+void test_sparse()
+{
+	struct orbit_scratch s;
+	struct orbit_repr *record;
+
+	scratch_init(&s, buf, SCRATCH_SIZE, 0);
+	range_init(16, 1001);
+	/* Adjacent changes share a run */
+	range[100] ^= 1;
+	range[101] ^= 1;
+	range[105] ^= 1;
+	memcpy(expect, range, RANGE_SIZE);
+
+	TEST_CHECK(orbit_scratch_push_delta(&s, range, orig, RANGE_SIZE) == 1);
+	TEST_CHECK(s.cursor < 17 * (sizeof(struct orbit_delta_run) + 8) +
+			sizeof(struct orbit_repr));
+
+	scratch_rewind(&s, 1);
+	record = orbit_scratch_first(&s);
+	TEST_ASSERT(record != NULL);
+	TEST_CHECK(record->type == ORBIT_DELTA);
+	TEST_CHECK(record->delta.ptr == range);
+	TEST_CHECK(record->delta.length == RANGE_SIZE);
+
+	/* Apply on top of the original, as the main program would */
+	memcpy(range, orig, RANGE_SIZE);
+	TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+	TEST_CHECK(memcmp(range, expect, RANGE_SIZE) == 0);
+}
+
+void test_unchanged()
+{
+	struct orbit_scratch s;
+
+	scratch_init(&s, buf, SCRATCH_SIZE, 0);
+	range_init(0, 1);
+
+	TEST_CHECK(orbit_scratch_push_delta(&s, range, orig, RANGE_SIZE) == 1);
+	TEST_CHECK(s.cursor == sizeof(struct orbit_repr));
+
+	scratch_rewind(&s, 1);
+	TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+	TEST_CHECK(memcmp(range, orig, RANGE_SIZE) == 0);
+}
+
+void test_dense_fallback()
+{
+	struct orbit_scratch s;
+	struct orbit_repr *record;
+
+	/* Every other byte changed: runs would be larger than the range */
+	scratch_init(&s, buf, SCRATCH_SIZE, 0);
+	range_init(RANGE_SIZE / 2, 2);
+
+	TEST_CHECK(orbit_scratch_push_delta(&s, range, orig, RANGE_SIZE) == 1);
+	scratch_rewind(&s, 1);
+	record = orbit_scratch_first(&s);
+	TEST_ASSERT(record != NULL);
+	TEST_CHECK(record->type == ORBIT_UPDATE);
+
+	memcpy(range, orig, RANGE_SIZE);
+	TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+	TEST_CHECK(memcmp(range, expect, RANGE_SIZE) == 0);
+}
+
+void test_small_scratch()
+{
+	struct orbit_scratch s;
+
+	/* Too small for a plain update, large enough for the delta */
+	scratch_init(&s, buf, 4096, 0);
+	range_init(4, 999);
+
+	TEST_CHECK(orbit_scratch_push_update(&s, range, RANGE_SIZE) == -1);
+	TEST_CHECK(orbit_scratch_push_delta(&s, range, orig, RANGE_SIZE) == 1);
+
+	scratch_rewind(&s, 1);
+	memcpy(range, orig, RANGE_SIZE);
+	TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+	TEST_CHECK(memcmp(range, expect, RANGE_SIZE) == 0);
+}
+
+TEST_LIST = {
+    { "sparse", test_sparse },
+    { "unchanged", test_unchanged },
+    { "dense_fallback", test_dense_fallback },
+    { "small_scratch", test_small_scratch },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
@@ -0,0 +1,29 @@
+/*
+ * Scratch fixture shared by the tests that build a scratch and read or
+ * apply it in the same process.  Such a scratch comes from no context and
+ * is never sent, so these tests run without orbit support in the kernel.
+ */
+#ifndef __ORBIT_TESTS_SCRATCH_HELPER_H__
+#define __ORBIT_TESTS_SCRATCH_HELPER_H__
+
+#include "orbit.h"
+#include <string.h>
+
+/* An empty scratch over the `size` bytes at `buf` */
+static inline void scratch_init(struct orbit_scratch *s, void *buf,
+		size_t size, unsigned long flags)
+{
+	memset(s, 0, sizeof(*s));
+	s->ptr = buf;
+	s->size_limit = size;
+	s->flags = flags;
+}
+
+/* Re-read the `count` records from the start, as the main program would */
+static inline void scratch_rewind(struct orbit_scratch *s, size_t count)
+{
+	s->cursor = 0;
+	s->count = count;
+}
+
+#endif /* __ORBIT_TESTS_SCRATCH_HELPER_H__ */
@@ -0,0 +1,166 @@
+/**
+ * This test file covers the offset index of sent scratches.
+ *
+ * The scratch is sealed and read back in the same process, as if it was
+ * received, so these tests do not need orbit support in the kernel.
+ */
+
+#include "orbit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "acutest.h"
+
+#define SCRATCH_SIZE (4096 * 16)
+#define NRECORD 100
+
+static char buf[SCRATCH_SIZE];
+static unsigned long values[NRECORD];
+static unsigned long sum;
+
+static unsigned long add_value(size_t argc, unsigned long argv[])
+{
+	(void)argc;
+	sum += argv[0];
+	return 0;
+}
+
+/* Every third record is an operation, the others updates of values[i] */
+static void scratch_fill(struct orbit_scratch *s, unsigned long flags)
+{
+	*s = (struct orbit_scratch) {
+		.ptr = buf,
+		.cursor = 0,
+		.size_limit = SCRATCH_SIZE,
+		.count = 0,
+		.any_alloc = NULL,
+		.ctx = NULL,
+		.flags = flags,
+	};
+	for (int i = 0; i < NRECORD; ++i) {
+		unsigned long argv[] = { (unsigned long)i };
+
+		values[i] = i + 1;
+		if (i % 3 == 0)
+			orbit_scratch_push_operation(s, add_value, 1, argv);
+		else
+			orbit_scratch_push_update(s, &values[i],
+					sizeof(values[i]));
+	}
+}
+
+/* What the main program gets from orbit_recvv */
+static void scratch_receive(struct orbit_scratch *r,
+		const struct orbit_scratch *s, size_t size)
+{
+	*r = (struct orbit_scratch) {
+		.ptr = s->ptr,
+		.cursor = 0,
+		.size_limit = size,
+		.count = s->count,
+		.any_alloc = NULL,
+		.ctx = NULL,
+		.flags = 0,
+	};
+}
+
+static void check_random_access(struct orbit_scratch *r)
+{
+	struct orbit_scratch part;
+	struct orbit_repr *record;
+
+	for (int i = 0; i < NRECORD; ++i) {
+		record = orbit_scratch_at(r, i);
+		TEST_ASSERT(record != NULL);
+		if (i % 3 == 0) {
+			TEST_CHECK(record->type == ORBIT_OPERATION);
+			TEST_CHECK(record->operation.argv[0] == (unsigned long)i);
+		} else {
+			TEST_CHECK(record->type == ORBIT_UPDATE);
+			TEST_CHECK(record->update.ptr == &values[i]);
+		}
+	}
+	TEST_CHECK(orbit_scratch_at(r, NRECORD) == NULL);
+
+	TEST_CHECK(orbit_scratch_count_type(r, ORBIT_OPERATION) ==
+			(NRECORD + 2) / 3);
+	TEST_CHECK(orbit_scratch_count_type(r, ORBIT_UPDATE) ==
+			NRECORD - (NRECORD + 2) / 3);
+	TEST_CHECK(orbit_scratch_count_type(r, ORBIT_ANY) == 0);
+
+	/* Apply the two halves in reverse order */
+	memset(values, 0, sizeof(values));
+	sum = 0;
+	TEST_CHECK(orbit_scratch_slice(r, NRECORD / 2, NRECORD / 2, &part) == 0);
+	TEST_CHECK(orbit_apply(&part, false) == ORBIT_END);
+	TEST_CHECK(values[NRECORD / 2 - 1] == 0);
+	TEST_CHECK(values[NRECORD / 2] == NRECORD / 2 + 1);
+	TEST_CHECK(orbit_scratch_slice(r, 0, NRECORD / 2, &part) == 0);
+	TEST_CHECK(orbit_apply(&part, false) == ORBIT_END);
+	for (int i = 0; i < NRECORD; ++i)
+		TEST_CHECK(values[i] == (i % 3 ? (unsigned long)i + 1 : 0));
+	TEST_CHECK(sum == 99 * 34 / 2);
+
+	TEST_CHECK(orbit_scratch_slice(r, NRECORD, 0, &part) == 0);
+	TEST_CHECK(orbit_scratch_slice(r, NRECORD / 2, NRECORD, &part) != 0);
+}
+
+void test_indexed()
+{
+	struct orbit_scratch s, r;
+	size_t size;
+
+	scratch_fill(&s, ORBIT_SCRATCH_INDEX);
+	size = orbit_scratch_seal(&s);
+	TEST_CHECK(size % 4096 == 0);
+	TEST_CHECK(size >= s.cursor + NRECORD * sizeof(struct orbit_index_entry));
+
+	scratch_receive(&r, &s, size);
+	TEST_CHECK(orbit_scratch_indexed(&r));
+	check_random_access(&r);
+}
+
+void test_not_indexed()
+{
+	struct orbit_scratch s, r;
+	size_t size;
+
+	/* Sealing without the flag hides the index left by the last one */
+	scratch_fill(&s, ORBIT_SCRATCH_INDEX);
+	size = orbit_scratch_seal(&s);
+	scratch_fill(&s, 0);
+	TEST_CHECK(orbit_scratch_seal(&s) == size);
+
+	scratch_receive(&r, &s, size);
+	TEST_CHECK(!orbit_scratch_indexed(&r));
+	check_random_access(&r);
+}
+
+void test_no_room()
+{
+	struct orbit_scratch s, r;
+	size_t size;
+
+	/* The index is skipped if it does not fit */
+	scratch_fill(&s, ORBIT_SCRATCH_INDEX);
+	s.size_limit = s.cursor;
+	size = orbit_scratch_seal(&s);
+
+	scratch_receive(&r, &s, size);
+	TEST_CHECK(!orbit_scratch_indexed(&r));
+	TEST_CHECK(orbit_scratch_at(&r, NRECORD - 1) != NULL);
+}
+
+TEST_LIST = {
+    { "indexed", test_indexed },
+    { "not_indexed", test_not_indexed },
+    { "no_room", test_no_room },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
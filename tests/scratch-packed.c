@@ -0,0 +1,211 @@
+/**
+ * This test file covers ORBIT_SCRATCH_PACKED: small updates take a fraction
+ * of the space of full records, apply in either address order, still read
+ * one by one with orbit_scratch_first() and orbit_scratch_next(), and are
+ * merged and packed again by orbit_scratch_compact().
+ */
+
+#include "orbit.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "acutest.h"
+#include "scratch-helper.h"
+
+#define SCRATCH_SIZE (4096 * 64)
+#define NFIELD 1000
+
+static char buf[SCRATCH_SIZE];
+
+/* Like the lock fields a checker marks */
+struct lock_t {
+	uint32_t modifiable_field;
+	uint32_t other;
+	uint64_t pad;
+};
+
+static struct lock_t locks[NFIELD];
+
+static size_t push_fields(struct orbit_scratch *s, int reverse)
+{
+	for (int i = 0; i < NFIELD; ++i) {
+		int j = reverse ? NFIELD - 1 - i : i;
+
+		locks[j].modifiable_field = j + 1;
+		TEST_ASSERT(orbit_scratch_push_update(s,
+				&locks[j].modifiable_field,
+				sizeof(locks[j].modifiable_field)) > 0);
+	}
+	return s->cursor;
+}
+
+void test_size()
+{
+	struct orbit_scratch s;
+	size_t full, packed;
+
+	scratch_init(&s, buf, sizeof(buf), 0);
+	full = push_fields(&s, 0);
+	TEST_CHECK(s.count == NFIELD);
+
+	scratch_init(&s, buf, sizeof(buf), ORBIT_SCRATCH_PACKED);
+	packed = push_fields(&s, 0);
+	TEST_CHECK(s.count == 1);
+	/* More updates go into the same record and do not add an element */
+	TEST_CHECK(orbit_scratch_push_update(&s, &locks[0].other,
+				sizeof(locks[0].other)) == 1);
+	/* The writer's position is not stored in the record */
+	TEST_CHECK(sizeof(struct orbit_packed) == 2 * sizeof(unsigned int));
+
+	TEST_CHECK(packed * 3 <= full);
+	TEST_MSG("full %lu bytes, packed %lu bytes", full, packed);
+}
+
+void test_apply()
+{
+	struct orbit_scratch s;
+	size_t count;
+
+	for (int reverse = 0; reverse < 2; ++reverse) {
+		scratch_init(&s, buf, sizeof(buf), ORBIT_SCRATCH_PACKED);
+		push_fields(&s, reverse);
+		count = s.count;
+
+		memset(locks, 0, sizeof(locks));
+		scratch_rewind(&s, count);
+		TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+		for (int i = 0; i < NFIELD; ++i) {
+			TEST_CHECK_(locks[i].modifiable_field ==
+				    (uint32_t)i + 1, "locks[%d]", i);
+			TEST_CHECK(locks[i].other == 0);
+		}
+	}
+}
+
+static unsigned long nop(size_t argc, unsigned long argv[])
+{
+	(void)argc;
+	(void)argv;
+	return 0;
+}
+
+void test_iterate()
+{
+	struct orbit_scratch s;
+	struct orbit_repr *record;
+	char big[ORBIT_PACKED_MAX + 1];
+	uint16_t small = 0xabcd;
+	char mid[20];
+	size_t count;
+	int i;
+
+	scratch_init(&s, buf, sizeof(buf), ORBIT_SCRATCH_PACKED);
+	push_fields(&s, 0);
+	/* An operation ends the packed record, a new one starts after it */
+	orbit_scratch_push_operation(&s, nop, 0, NULL);
+	orbit_scratch_push_update(&s, &small, sizeof(small));
+	memset(mid, 'm', sizeof(mid));
+	orbit_scratch_push_update(&s, mid, sizeof(mid));
+	/* Too large to be packed */
+	memset(big, 'b', sizeof(big));
+	orbit_scratch_push_update(&s, big, sizeof(big));
+	count = s.count;
+	TEST_CHECK(count == 4);
+
+	scratch_rewind(&s, count);
+	record = orbit_scratch_first(&s);
+	for (i = 0; i < NFIELD; ++i) {
+		TEST_ASSERT(record != NULL);
+		TEST_CHECK(record->type == ORBIT_UPDATE);
+		TEST_CHECK(record->update.ptr == &locks[i].modifiable_field);
+		TEST_CHECK(record->update.length == sizeof(uint32_t));
+		TEST_CHECK(*(uint32_t*)record->update.data == (uint32_t)i + 1);
+		record = orbit_scratch_next(&s);
+	}
+
+	TEST_ASSERT(record != NULL);
+	TEST_CHECK(record->type == ORBIT_OPERATION);
+
+	record = orbit_scratch_next(&s);
+	TEST_ASSERT(record != NULL);
+	TEST_CHECK(record->update.ptr == &small);
+	TEST_CHECK(*(uint16_t*)record->update.data == 0xabcd);
+
+	record = orbit_scratch_next(&s);
+	TEST_ASSERT(record != NULL);
+	TEST_CHECK(record->update.ptr == mid);
+	TEST_CHECK(record->update.length == sizeof(mid));
+	TEST_CHECK(memcmp(record->update.data, mid, sizeof(mid)) == 0);
+
+	record = orbit_scratch_next(&s);
+	TEST_ASSERT(record != NULL);
+	TEST_CHECK(record->type == ORBIT_UPDATE);
+	TEST_CHECK(record->update.ptr == big);
+	TEST_CHECK(record->update.length == sizeof(big));
+
+	TEST_CHECK(orbit_scratch_next(&s) == NULL);
+}
+
+void test_compact()
+{
+	struct orbit_scratch s;
+	struct orbit_repr *record;
+	uint32_t last = 0x55;
+	size_t count, cursor;
+
+	/* Packed updates are merged and packed again in address order */
+	scratch_init(&s, buf, sizeof(buf), ORBIT_SCRATCH_PACKED);
+	push_fields(&s, 1);
+	memcpy(&locks[0].modifiable_field, &last, sizeof(last));
+	orbit_scratch_push_update(&s, &locks[0].modifiable_field, sizeof(last));
+	TEST_CHECK(orbit_scratch_compact(&s) == 1);
+	count = s.count;
+
+	s.cursor = 0;
+	record = orbit_scratch_first(&s);
+	for (int i = 0; i < NFIELD; ++i) {
+		TEST_ASSERT(record != NULL);
+		TEST_CHECK(record->update.ptr == &locks[i].modifiable_field);
+		record = orbit_scratch_next(&s);
+	}
+	TEST_CHECK(record == NULL);
+
+	memset(locks, 0, sizeof(locks));
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+	TEST_CHECK(locks[0].modifiable_field == 0x55);
+	for (int i = 1; i < NFIELD; ++i)
+		TEST_CHECK_(locks[i].modifiable_field == (uint32_t)i + 1,
+			    "locks[%d]", i);
+
+	/* Without the flag they come out as plain updates, if they fit */
+	scratch_init(&s, buf, sizeof(buf), ORBIT_SCRATCH_PACKED);
+	cursor = push_fields(&s, 0);
+	s.flags = 0;
+	s.size_limit = cursor;
+	TEST_CHECK(orbit_scratch_compact(&s) == -1);
+	TEST_CHECK(errno == ENOSPC);
+	TEST_CHECK(s.count == 1 && s.cursor == cursor);
+
+	s.size_limit = SCRATCH_SIZE;
+	TEST_CHECK(orbit_scratch_compact(&s) == NFIELD);
+	s.cursor = 0;
+	TEST_CHECK(orbit_scratch_first(&s)->type == ORBIT_UPDATE);
+}
+
+TEST_LIST = {
+    { "size", test_size },
+    { "apply", test_apply },
+    { "iterate", test_iterate },
+    { "compact", test_compact },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
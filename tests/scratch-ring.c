@@ -0,0 +1,200 @@
+#include "orbit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "acutest.h"
+
+#define ROUNDS 64
+#define DATA_SIZE (4096 * 2)
+
+struct ring_args {
+	char *data;
+	int round;
+};
+
+unsigned long ring_entry(void *store, void *_args)
+{
+	(void)store;
+	struct ring_args *args = (struct ring_args *)_args;
+	struct orbit_scratch s;
+
+	if (orbit_scratch_create(&s) != 0)
+		return 1;
+	memset(args->data, args->round, DATA_SIZE);
+	if (orbit_scratch_push_update(&s, args->data, DATA_SIZE) < 0)
+		return 2;
+	if (orbit_sendv(&s) < 0)
+		return 3;
+	return 0;
+}
+
+void test_scratch_ring()
+{
+	struct orbit_pool *pool, *scratch_pool;
+	struct orbit_allocator *alloc;
+	struct orbit_module *m;
+	struct orbit_task task;
+	union orbit_result result;
+	struct ring_args args;
+	int ret;
+
+	m = orbit_create("scratch_ring", ring_entry, NULL);
+	TEST_ASSERT(m != NULL);
+	/* Room for one control page and one scratch */
+	scratch_pool = orbit_pool_create(m, 4096 + DATA_SIZE + 4096);
+	TEST_ASSERT(scratch_pool != NULL);
+	TEST_ASSERT(orbit_scratch_set_pool(scratch_pool) == 0);
+
+	pool = orbit_pool_create(m, DATA_SIZE);
+	alloc = orbit_allocator_from_pool(pool, false);
+	args.data = (char *)orbit_alloc(alloc, DATA_SIZE);
+
+	/* Many more scratches than the ring can hold without reuse */
+	for (int i = 0; i < ROUNDS; ++i) {
+		args.round = i;
+		ret = orbit_call_async(m, 0, 1, &pool, NULL, &args,
+				       sizeof(args), &task);
+		TEST_ASSERT(ret == 0);
+
+		ret = orbit_recvv(&result, &task);
+		if (!TEST_CHECK(ret == 1))
+			TEST_MSG("round %d: recvv returned %d", i, ret);
+		TEST_CHECK(orbit_apply(&result.scratch, false) == ORBIT_END);
+		TEST_CHECK(args.data[0] == i && args.data[DATA_SIZE - 1] == i);
+		TEST_CHECK(orbit_recvv_finish(&result.scratch) == 0);
+
+		ret = orbit_recvv(&result, &task);
+		TEST_CHECK(ret == 0);
+		TEST_CHECK(result.retval == 0);
+	}
+
+	ret = orbit_destroy(m->gobid);
+	TEST_ASSERT(ret == 0);
+}
+
+#define NVALUE 1000
+
+unsigned long autoflush_entry(void *store, void *_args)
+{
+	(void)store;
+	unsigned long *values = *(unsigned long **)_args;
+	struct orbit_scratch s;
+
+	if (orbit_scratch_create(&s) != 0)
+		return 1;
+	if (orbit_scratch_set_autoflush(&s, 4096) != 0)
+		return 2;
+	for (int i = 0; i < NVALUE; ++i) {
+		values[i] = i + 1;
+		if (orbit_scratch_push_update(&s, &values[i],
+					      sizeof(values[i])) < 0)
+			return 3;
+	}
+	if (orbit_sendv(&s) < 0)
+		return 4;
+	return 0;
+}
+
+/* Deltas fill each segment before the threshold is reached, so it is sent
+ * when the next record does not fit. */
+#define DELTA_ROUNDS 16
+#define DELTA_BLOCK 64
+
+unsigned long autoflush_delta_entry(void *store, void *_args)
+{
+	(void)store;
+	unsigned long *values = *(unsigned long **)_args;
+	unsigned long orig[DELTA_BLOCK];
+	struct orbit_scratch s;
+
+	if (orbit_scratch_create(&s) != 0)
+		return 1;
+	if (orbit_scratch_set_autoflush(&s, s.size_limit) != 0)
+		return 2;
+	for (int round = 0; round < DELTA_ROUNDS; ++round) {
+		for (int i = 0; i < NVALUE; i += DELTA_BLOCK) {
+			int n = NVALUE - i < DELTA_BLOCK ? NVALUE - i
+							 : DELTA_BLOCK;
+
+			memcpy(orig, &values[i], n * sizeof(*values));
+			for (int j = i; j < i + n; ++j)
+				values[j] = round * NVALUE + j + 1;
+			if (orbit_scratch_push_delta(&s, &values[i], orig,
+						     n * sizeof(*values)) < 0)
+				return 3;
+		}
+	}
+	if (orbit_sendv(&s) < 0)
+		return 4;
+	return 0;
+}
+
+static void check_autoflush(const char *name, orbit_entry entry,
+		unsigned long base)
+{
+	struct orbit_pool *pool, *scratch_pool;
+	struct orbit_allocator *alloc;
+	struct orbit_module *m;
+	struct orbit_task task;
+	union orbit_result result;
+	unsigned long *values;
+	int ret, segments = 0;
+
+	m = orbit_create(name, entry, NULL);
+	TEST_ASSERT(m != NULL);
+	scratch_pool = orbit_pool_create(m, 4096 + 4096 * 8);
+	TEST_ASSERT(scratch_pool != NULL);
+	TEST_ASSERT(orbit_scratch_set_pool(scratch_pool) == 0);
+
+	pool = orbit_pool_create(m, NVALUE * sizeof(*values));
+	alloc = orbit_allocator_from_pool(pool, false);
+	values = (unsigned long *)orbit_alloc(alloc, NVALUE * sizeof(*values));
+	memset(values, 0, NVALUE * sizeof(*values));
+
+	ret = orbit_call_async(m, 0, 1, &pool, NULL, &values, sizeof(values),
+			       &task);
+	TEST_ASSERT(ret == 0);
+
+	/* Each segment arrives as a scratch of its own */
+	while ((ret = orbit_recvv(&result, &task)) == 1) {
+		TEST_CHECK(orbit_apply(&result.scratch, false) == ORBIT_END);
+		TEST_CHECK(orbit_recvv_finish(&result.scratch) == 0);
+		++segments;
+	}
+	TEST_CHECK(ret == 0);
+	TEST_CHECK(result.retval == 0);
+	TEST_CHECK(segments > 1);
+	TEST_MSG("received %d segments", segments);
+	for (int i = 0; i < NVALUE; ++i)
+		TEST_CHECK(values[i] == base + i + 1);
+
+	ret = orbit_destroy(m->gobid);
+	TEST_ASSERT(ret == 0);
+}
+
+void test_autoflush()
+{
+	check_autoflush("scratch_autoflush", autoflush_entry, 0);
+}
+
+void test_autoflush_delta()
+{
+	check_autoflush("scratch_autoflush_delta", autoflush_delta_entry,
+			(DELTA_ROUNDS - 1) * NVALUE);
+}
+
+TEST_LIST = {
+    { "scratch_ring", test_scratch_ring },
+    { "autoflush", test_autoflush },
+    { "autoflush_delta", test_autoflush_delta },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
@@ -0,0 +1,127 @@
+/**
+ * This test file covers fixed-width store records: the orbit_scratch_push_u*
+ * functions, orbit::push picking the width from the type of the target, and
+ * applying many stores with orbit_apply_parallel().
+ */
+
+#include "orbit.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "acutest.h"
+#include "scratch-helper.h"
+
+#define SCRATCH_SIZE (4096 * 32)
+
+static char buf[SCRATCH_SIZE];
+
+void test_c_api()
+{
+	struct orbit_scratch s;
+	uint8_t u8 = 0;
+	uint16_t u16 = 0;
+	uint32_t u32 = 0;
+	uint64_t u64 = 0;
+	struct orbit_repr *record;
+	size_t count;
+
+	scratch_init(&s, buf, sizeof(buf), 0);
+	TEST_CHECK(orbit_scratch_push_u8(&s, &u8, 0x12) == 1);
+	TEST_CHECK(orbit_scratch_push_u16(&s, &u16, 0x1234) == 2);
+	TEST_CHECK(orbit_scratch_push_u32(&s, &u32, 0x12345678) == 3);
+	TEST_CHECK(orbit_scratch_push_u64(&s, &u64, 0x123456789abcdef0) == 4);
+	/* A fixed-size record, with nothing after the header */
+	TEST_CHECK(s.cursor == 4 * sizeof(struct orbit_repr));
+	count = s.count;
+
+	/* Pushing does not read or write the target */
+	TEST_CHECK(u8 == 0 && u16 == 0 && u32 == 0 && u64 == 0);
+
+	scratch_rewind(&s, count);
+	record = orbit_scratch_first(&s);
+	TEST_ASSERT(record != NULL);
+	TEST_CHECK(record->type == ORBIT_STORE8);
+	TEST_CHECK(record->store.ptr == &u8);
+	TEST_CHECK(record->store.value == 0x12);
+	record = orbit_scratch_next(&s);
+	TEST_ASSERT(record != NULL);
+	TEST_CHECK(record->type == ORBIT_STORE16);
+	record = orbit_scratch_next(&s);
+	TEST_ASSERT(record != NULL);
+	TEST_CHECK(record->type == ORBIT_STORE32);
+	record = orbit_scratch_next(&s);
+	TEST_ASSERT(record != NULL);
+	TEST_CHECK(record->type == ORBIT_STORE64);
+	TEST_CHECK(orbit_scratch_next(&s) == NULL);
+
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+	TEST_CHECK(u8 == 0x12);
+	TEST_CHECK(u16 == 0x1234);
+	TEST_CHECK(u32 == 0x12345678);
+	TEST_CHECK(u64 == 0x123456789abcdef0);
+}
+
+enum class trx_state : int32_t { active, victim };
+
+struct trx_t {
+	bool marked;
+	trx_state state;
+	double weight;
+	trx_t *next;
+};
+
+void test_push_template()
+{
+	struct orbit_scratch s;
+	trx_t trx;
+	trx_t other;
+	size_t count;
+
+	memset(&trx, 0, sizeof(trx));
+	scratch_init(&s, buf, sizeof(buf), 0);
+	TEST_CHECK(orbit::push(&s, &trx.marked, true) > 0);
+	TEST_CHECK(orbit::push(&s, &trx.state, trx_state::victim) > 0);
+	TEST_CHECK(orbit::push(&s, &trx.weight, 2.5) > 0);
+	TEST_CHECK(orbit::push(&s, &trx.next, &other) > 0);
+	count = s.count;
+
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_apply(&s, false) == ORBIT_END);
+	TEST_CHECK(trx.marked);
+	TEST_CHECK(trx.state == trx_state::victim);
+	TEST_CHECK(trx.weight == 2.5);
+	TEST_CHECK(trx.next == &other);
+}
+
+void test_parallel()
+{
+	const int N = 4096;
+	struct orbit_scratch s;
+	static uint32_t values[N];
+	size_t count;
+
+	scratch_init(&s, buf, sizeof(buf), 0);
+	for (int i = 0; i < N; ++i)
+		TEST_ASSERT(orbit::push(&s, &values[i], (uint32_t)i * 5) > 0);
+	count = s.count;
+
+	scratch_rewind(&s, count);
+	TEST_CHECK(orbit_apply_parallel(&s, 4) == ORBIT_END);
+	for (int i = 0; i < N; ++i)
+		TEST_CHECK_(values[i] == (uint32_t)i * 5, "values[%d]", i);
+}
+
+TEST_LIST = {
+    { "c_api", test_c_api },
+    { "push_template", test_push_template },
+    { "parallel", test_parallel },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	acutest_no_exec_ = 1;
+	acutest_verbose_level_ = 3;
+	return acutest_execute_main(argc, argv);
+}
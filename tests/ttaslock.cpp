@@ -882,7 +882,8 @@ int main(int argc, const char *argv[]) {
 	new (mutex) TTASEventMutex();
 	mutex->init("", 0);
 
-	std::atomic_uint64_t *counter = (std::atomic_uint64_t*)orbit_alloc(alloc, sizeof(std::atomic_uint64_t));
+	/* The counter is updated by all threads, keep it off the mutex line. */
+	std::atomic_uint64_t *counter = (std::atomic_uint64_t*)orbit_alloc_isolated(alloc, sizeof(std::atomic_uint64_t));
 
 	thread_args args = {
 		.ob = ob,